@@ -19,51 +19,527 @@
 // LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
+// Peripheral addresses above 2GB (BCM2711) need a 64-bit off_t for mmap().
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bcm2708.h"
+#include "realtime.h"
 
-#define BASE 0x20000000
-#define GPIO_BASE (BASE + 0x200000)
+// Peripheral base of the original BCM2835, used when there is no device tree.
+#define LEGACY_BASE 0x20000000
+#define GPIO_OFFSET 0x200000
 #define GPIO_LENGTH 4096
-#define BCM2708_ST_BASE 0x20003000 /* BCM 2708 System Timer */
+#define ST_OFFSET 0x3000 /* BCM 2708 System Timer */
 
 volatile uint32_t* pi_mmio_gpio = NULL;
 volatile uint32_t *pi_mmio_timer = NULL;
 
+static const char *devicetreeRoot = "/proc/device-tree";
+
+void pi_mmio_set_devicetree_root(const char *root) {
+	devicetreeRoot = (root != NULL) ? root : "/proc/device-tree";
+}
+
+// Read up to (size) bytes of device tree property (name) into (buff).
+// Returns number of bytes read, or -1 if the property does not exist.
+static int readDevicetree(const char *name, uint8_t *buff, size_t size) {
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", devicetreeRoot, name);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+	ssize_t n = read(fd, buff, size);
+	close(fd);
+	return (int)n;
+}
+
+static uint32_t readCell(const uint8_t *p) {
+	// Device tree cells are big endian.
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Look for a known SoC in the NUL separated list of compatible strings.
+static pi_soc_t socFromCompatible(const char *compatible, int length) {
+	static const struct {
+		const char *name;
+		pi_soc_t soc;
+	} table[] = {
+		{ "brcm,bcm2712", PI_SOC_BCM2712 },
+		{ "brcm,bcm2711", PI_SOC_BCM2711 },
+		{ "brcm,bcm2837", PI_SOC_BCM2837 },
+		{ "brcm,bcm2710", PI_SOC_BCM2837 },
+		{ "brcm,bcm2836", PI_SOC_BCM2836 },
+		{ "brcm,bcm2709", PI_SOC_BCM2836 },
+		{ "brcm,bcm2835", PI_SOC_BCM2835 },
+		{ "brcm,bcm2708", PI_SOC_BCM2835 },
+	};
+	int offset = 0;
+	while (offset < length) {
+		const char *entry = compatible + offset;
+		size_t i;
+		for (i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+			if (strcmp(entry, table[i].name) == 0) {
+				return table[i].soc;
+			}
+		}
+		offset += strlen(entry) + 1;
+	}
+	return PI_SOC_UNKNOWN;
+}
+
+pi_soc_t pi_mmio_detect_soc(uint64_t *pPeripheralBase) {
+	char compatible[256];
+	int length = readDevicetree("compatible", (uint8_t*)compatible, sizeof(compatible) - 1);
+	pi_soc_t soc = PI_SOC_UNKNOWN;
+	if (length > 0) {
+		compatible[length] = '\0';
+		soc = socFromCompatible(compatible, length);
+	}
+
+	// The first entry of soc/ranges maps the 0x7e000000 bus address to the
+	// ARM physical peripheral base.  The parent address is one cell up to the
+	// BCM2837 and two cells (high cell zero) on the BCM2711.
+	uint64_t base = 0;
+	uint8_t ranges[16];
+	if (soc != PI_SOC_BCM2712 && readDevicetree("soc/ranges", ranges, sizeof(ranges)) >= 12) {
+		base = readCell(ranges + 4);
+		if (base == 0) {
+			base = readCell(ranges + 8);
+		}
+	}
+	if (soc == PI_SOC_UNKNOWN) {
+		// Old device trees lack the SoC in compatible, so guess from the base.
+		switch (base) {
+		case 0x20000000: soc = PI_SOC_BCM2835; break;
+		case 0x3F000000: soc = PI_SOC_BCM2837; break;
+		case 0xFE000000: soc = PI_SOC_BCM2711; break;
+		}
+	}
+	if (base == 0) {
+		switch (soc) {
+		case PI_SOC_BCM2836:
+		case PI_SOC_BCM2837: base = 0x3F000000; break;
+		case PI_SOC_BCM2711: base = 0xFE000000; break;
+		case PI_SOC_BCM2712: base = 0; break;
+		default: base = LEGACY_BASE; break;
+		}
+	}
+	if (pPeripheralBase != NULL) {
+		*pPeripheralBase = base;
+	}
+	return soc;
+}
+
+static pi_mmio_mode_t mmioMode = PI_MMIO_MODE_AUTO;
+
+void pi_mmio_set_mode(pi_mmio_mode_t mode) {
+	mmioMode = mode;
+}
+
+// Map GPIO and the system timer through /dev/mem.
+static int mapDevmem(uint64_t base) {
+	int fd = open("/dev/mem", O_RDWR | O_SYNC);
+	if (fd == -1) {
+		// Error opening /dev/mem.  Probably not running as root.
+		return MMIO_ERROR_DEVMEM;
+	}
+	// Map GPIO memory to location in process space.
+	void *gpio = mmap(NULL, GPIO_LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)(base + GPIO_OFFSET));
+	// Map System Timer register to location in process space
+	void *timer = mmap(NULL, GPIO_LENGTH, PROT_READ /*|PROT_WRITE*/, MAP_SHARED, fd, (off_t)(base + ST_OFFSET));
+
+	close(fd);
+	if (gpio == MAP_FAILED || timer == MAP_FAILED) {
+		// Don't save the result if the memory mapping failed.
+		if (gpio != MAP_FAILED) {
+			munmap(gpio, GPIO_LENGTH);
+		}
+		if (timer != MAP_FAILED) {
+			munmap(timer, GPIO_LENGTH);
+		}
+		return MMIO_ERROR_MMAP;
+	}
+	pi_mmio_gpio = (uint32_t*)gpio;
+	pi_mmio_timer = (uint32_t*)timer;
+	return MMIO_SUCCESS;
+}
+
+// Map GPIO only through /dev/gpiomem, which is accessible to the gpio group.
+static int mapGpiomem(void) {
+	int fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
+	if (fd == -1) {
+		return MMIO_ERROR_GPIOMEM;
+	}
+	void *gpio = mmap(NULL, GPIO_LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (gpio == MAP_FAILED) {
+		return MMIO_ERROR_MMAP;
+	}
+	pi_mmio_gpio = (uint32_t*)gpio;
+	return MMIO_SUCCESS;
+}
+
+static uint32_t systemTimerMicros(void) {
+	return pi_timer_micros();
+}
+
+static uint64_t systemTimerMicros64(void) {
+	return pi_timer_micros64();
+}
+
+static uint64_t monotonicRawMicros64(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t monotonicRawMicros(void) {
+	return (uint32_t)monotonicRawMicros64();
+}
+
+static uint64_t monotonicMicros64(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t monotonicMicros(void) {
+	return (uint32_t)monotonicMicros64();
+}
+
+static uint32_t (*const timerFunctions[PI_TIMER_SOURCES])(void) = {
+	systemTimerMicros,
+	monotonicRawMicros,
+	monotonicMicros,
+};
+
+static uint64_t (*const timerFunctions64[PI_TIMER_SOURCES])(void) = {
+	systemTimerMicros64,
+	monotonicRawMicros64,
+	monotonicMicros64,
+};
+
+static const char *const timerNames[PI_TIMER_SOURCES] = {
+	"system timer",
+	"CLOCK_MONOTONIC_RAW",
+	"CLOCK_MONOTONIC",
+};
+
+static pi_timer_calibration_t timerCalibration[PI_TIMER_SOURCES];
+static pi_timer_source_t timerSource = PI_TIMER_MONOTONIC_RAW;
+
+// Reads per timer source during calibration.
+#define CALIBRATION_READS 1000
+// A source must tick at least every microsecond with less jitter than this
+// to be used for pulse width measurement.
+#define MAX_ACCURATE_JITTER_NS 2000
+
+static uint64_t referenceNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compareU32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+// Measure median and 99th percentile of the time (function) takes, bracketed
+// by the reference clock, with the cost of the reference itself removed.
+static void measureCost(uint32_t (*function)(void), uint32_t *pMedian, uint32_t *pP99) {
+	static uint32_t samples[CALIBRATION_READS];
+	int i;
+	for (i = 0; i < CALIBRATION_READS; i++) {
+		uint64_t started = referenceNanos();
+		if (function != NULL) {
+			function();
+		}
+		samples[i] = (uint32_t)(referenceNanos() - started);
+	}
+	qsort(samples, CALIBRATION_READS, sizeof(samples[0]), compareU32);
+	*pMedian = samples[CALIBRATION_READS / 2];
+	*pP99 = samples[CALIBRATION_READS * 99 / 100];
+}
+
+// Measure every usable timer source and pick the cheapest accurate one.
+static void calibrateTimers(void) {
+	uint32_t overhead, overheadP99;
+	measureCost(NULL, &overhead, &overheadP99);
+	int best = -1;
+	int i;
+	for (i = 0; i < PI_TIMER_SOURCES; i++) {
+		pi_timer_calibration_t *c = &timerCalibration[i];
+		memset(c, 0, sizeof(*c));
+		if (i == PI_TIMER_SYSTEM) {
+			if (pi_mmio_timer == NULL) {
+				continue;
+			}
+			c->resolutionNanos = 1000;
+		} else {
+			struct timespec res;
+			clockid_t id = (i == PI_TIMER_MONOTONIC_RAW) ? CLOCK_MONOTONIC_RAW : CLOCK_MONOTONIC;
+			if (clock_getres(id, &res) != 0) {
+				continue;
+			}
+			c->resolutionNanos = (uint32_t)(res.tv_sec * 1000000000 + res.tv_nsec);
+		}
+		uint32_t median, p99;
+		measureCost(timerFunctions[i], &median, &p99);
+		c->available = 1;
+		c->costNanos = (median > overhead) ? median - overhead : 0;
+		c->jitterNanos = p99 - median;
+		bool accurate = c->resolutionNanos <= 1000 && c->jitterNanos <= MAX_ACCURATE_JITTER_NS;
+		if (!accurate) {
+			continue;
+		}
+		if (best < 0 || c->costNanos < timerCalibration[best].costNanos) {
+			best = i;
+		}
+	}
+	// Without an accurate source fall back to the least jittery available one.
+	if (best < 0) {
+		for (i = 0; i < PI_TIMER_SOURCES; i++) {
+			if (timerCalibration[i].available &&
+			    (best < 0 || timerCalibration[i].jitterNanos < timerCalibration[best].jitterNanos)) {
+				best = i;
+			}
+		}
+	}
+	timerSource = (best < 0) ? PI_TIMER_MONOTONIC_RAW : (pi_timer_source_t)best;
+	pi_mmio_backend.timer_micros = timerFunctions[timerSource];
+	pi_mmio_backend.timer_micros64 = timerFunctions64[timerSource];
+}
+
+// Function select registers hold the mode of ten pins each and are updated
+// by read-modify-write, so processes reading sensors on pins sharing a
+// register serialize the update with a lock file per register.  flock()
+// doesn't tell apart the threads sharing the process's descriptor, so they
+// serialize it with a mutex per register as well.
+#define SELECT_REGISTERS 6
+#define SELECT_LOCKFILE_FORMAT "/run/lock/dht_read.gpfsel%d.lck"
+
+// Longest wait for the registers of a start pulse, which fails the read
+// instead of waiting for a process that may wait for this one.
+#define SELECT_LOCK_TIMEOUT_MS 1000
+#define SELECT_LOCK_POLL_MS 1
+
+static int selectLockFds[SELECT_REGISTERS] = { -1, -1, -1, -1, -1, -1 };
+static pthread_mutex_t selectMutexes[SELECT_REGISTERS] = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void openSelectLocks(void) {
+	int i;
+	for (i = 0; i < SELECT_REGISTERS; i++) {
+		if (selectLockFds[i] < 0) {
+			char filename[sizeof(SELECT_LOCKFILE_FORMAT)];
+			snprintf(filename, sizeof(filename), SELECT_LOCKFILE_FORMAT, i);
+			// Without a lock file, updates are as racy as in other GPIO libraries.
+			selectLockFds[i] = open(filename, O_CREAT | O_RDONLY | O_CLOEXEC, 0644);
+		}
+	}
+}
+
+static bool pastDeadline(const struct timespec *deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// Lock select register (reg) against other threads and processes, waiting
+// until (deadline) (CLOCK_REALTIME), or for as long as it takes if NULL.
+// Returns 0, or -1 with nothing locked.
+static int lockSelect(int reg, const struct timespec *deadline) {
+	if (deadline == NULL) {
+		pthread_mutex_lock(&selectMutexes[reg]);
+	} else if (pthread_mutex_timedlock(&selectMutexes[reg], deadline) != 0) {
+		return -1;
+	}
+	int fd = selectLockFds[reg];
+	if (fd >= 0) {
+		int result;
+		while ((result = flock(fd, deadline == NULL ? LOCK_EX : LOCK_EX | LOCK_NB)) == -1 &&
+				(errno == EINTR || (errno == EWOULDBLOCK && !pastDeadline(deadline)))) {
+			if (errno == EWOULDBLOCK) {
+				sleep_milliseconds(SELECT_LOCK_POLL_MS);
+			}
+		}
+		if (result == -1 && errno == EWOULDBLOCK) {
+			pthread_mutex_unlock(&selectMutexes[reg]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void unlockSelect(int reg) {
+	if (selectLockFds[reg] >= 0) {
+		flock(selectLockFds[reg], LOCK_UN);
+	}
+	pthread_mutex_unlock(&selectMutexes[reg]);
+}
+
 int pi_mmio_init(void) {
 	if (pi_mmio_gpio == NULL) {
-		int fd = open("/dev/mem", O_RDWR | O_SYNC);
-		if (fd == -1) {
-			// Error opening /dev/mem.  Probably not running as root.
-			return MMIO_ERROR_DEVMEM;
+		uint64_t base;
+		if (pi_mmio_detect_soc(&base) == PI_SOC_BCM2712) {
+			// GPIO of the BCM2712 is on the RP1 south bridge with a different
+			// register layout.
+			return MMIO_ERROR_UNSUPPORTED;
 		}
-		// Map GPIO memory to location in process space.
-		pi_mmio_gpio = (uint32_t*)mmap(NULL, GPIO_LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, fd, GPIO_BASE);
-		// Map System Timer register to location in process space
-		pi_mmio_timer =(uint32_t*) mmap(NULL, GPIO_LENGTH, PROT_READ /*|PROT_WRITE*/, MAP_SHARED, fd, BCM2708_ST_BASE);
-
-		close(fd);
-		if (pi_mmio_gpio == MAP_FAILED || pi_mmio_timer == MAP_FAILED) {
-			// Don't save the result if the memory mapping failed.
-			pi_mmio_gpio = pi_mmio_timer = NULL;
-			return MMIO_ERROR_MMAP;
+		int result = MMIO_ERROR_DEVMEM;
+		if (mmioMode != PI_MMIO_MODE_GPIOMEM) {
+			result = mapDevmem(base);
+		}
+		if (result < 0 && mmioMode != PI_MMIO_MODE_DEVMEM) {
+			// Not root: GPIO through /dev/gpiomem and a clock_gettime() timer.
+			result = mapGpiomem();
 		}
+		if (result < 0) {
+			return result;
+		}
+		openSelectLocks();
+		calibrateTimers();
 	}
 	return MMIO_SUCCESS;
 }
 
+pi_timer_source_t pi_timer_source(void) {
+	return timerSource;
+}
+
+const pi_timer_calibration_t *pi_timer_calibration(pi_timer_source_t source) {
+	return (source < PI_TIMER_SOURCES) ? &timerCalibration[source] : NULL;
+}
+
+const char *pi_timer_source_name(pi_timer_source_t source) {
+	return (source < PI_TIMER_SOURCES) ? timerNames[source] : "unknown";
+}
+
 void pi_timer_sleep_micros(uint32_t micros) {
-	uint32_t start = pi_timer_micros();
+	uint32_t start = pi_mmio_backend.timer_micros();
 	uint32_t elapsed = 0;
 	while (elapsed < micros) {
-		elapsed = pi_timer_micros() - start;
+		elapsed = pi_mmio_backend.timer_micros() - start;
+	}
+}
+
+// Start pulse timed on the calibrated timer (the system timer when mapped).
+static void mmio_busy_wait_millis(uint32_t millis) {
+	hybrid_wait_micros(millis * 1000, pi_mmio_backend.timer_micros);
+}
+
+// Pins of every select register whose start pulse, begun by this thread,
+// holds the register's locks: set_input() releases them without locking
+// first, and drops the locks with the last one.
+static __thread uint16_t pulsePins[SELECT_REGISTERS];
+
+// Take the locks of the select registers of all pins in (pinMask), in
+// increasing order so overlapping starts can't deadlock, and for at most
+// SELECT_LOCK_TIMEOUT_MS.  Returns 0 with all held, or -1 with none.
+static int mmio_begin_start(uint64_t pinMask) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += SELECT_LOCK_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += (SELECT_LOCK_TIMEOUT_MS % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	int reg;
+	for (reg = 0; reg < SELECT_REGISTERS; reg++) {
+		uint16_t pins = (pinMask >> (reg * 10)) & ((1u << 10) - 1);
+		if (pins == 0) {
+			continue;
+		}
+		if (lockSelect(reg, &deadline) < 0) {
+			while (--reg >= 0) {
+				if (((pinMask >> (reg * 10)) & ((1u << 10) - 1)) != 0) {
+					pulsePins[reg] = 0;
+					unlockSelect(reg);
+				}
+			}
+			return -1;
+		}
+		pulsePins[reg] = pins;
 	}
+	return 0;
+}
+
+static void mmio_set_input(int pin) {
+	int reg = pin / 10;
+	if (pin < 0 || reg >= SELECT_REGISTERS) {
+		pi_mmio_set_input(pin);
+	} else if (pulsePins[reg] & (1u << (pin % 10))) {
+		pi_mmio_set_input(pin);
+		pulsePins[reg] &= ~(1u << (pin % 10));
+		if (pulsePins[reg] == 0) {
+			unlockSelect(reg);
+		}
+	} else {
+		lockSelect(reg, NULL);
+		pi_mmio_set_input(pin);
+		unlockSelect(reg);
+	}
+}
+
+static void mmio_set_output(int pin) {
+	int reg = pin / 10;
+	if (pin < 0 || reg >= SELECT_REGISTERS) {
+		pi_mmio_set_output(pin);
+	} else {
+		lockSelect(reg, NULL);
+		pi_mmio_set_output(pin);
+		unlockSelect(reg);
+	}
+}
+
+static void mmio_set_high(int pin) {
+	pi_mmio_set_high(pin);
+}
+
+static void mmio_set_low(int pin) {
+	pi_mmio_set_low(pin);
+}
+
+static uint32_t mmio_input(int pin) {
+	return pi_mmio_input(pin);
+}
+
+static uint32_t mmio_input_all(void) {
+	return pi_mmio_input_all();
 }
 
+dht_backend_t pi_mmio_backend = {
+	.name = "MMIO",
+	.init = pi_mmio_init,
+	.set_input = mmio_set_input,
+	.set_output = mmio_set_output,
+	.set_high = mmio_set_high,
+	.set_low = mmio_set_low,
+	.begin_start = mmio_begin_start,
+	.input = mmio_input,
+	.input_all = mmio_input_all,
+	.timer_micros = monotonicRawMicros,
+	.timer_micros64 = monotonicRawMicros64,
+	.sleep_millis = sleep_milliseconds,
+	.busy_wait_millis = mmio_busy_wait_millis,
+};
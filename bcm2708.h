@@ -26,15 +26,67 @@
 
 #include <stdint.h>
 
+#include "dht_backend.h"
+
 #define MMIO_SUCCESS 0
 #define MMIO_ERROR_DEVMEM -1
 #define MMIO_ERROR_MMAP -2
-
-volatile uint32_t* pi_mmio_gpio;
-volatile uint32_t *pi_mmio_timer;
+#define MMIO_ERROR_UNSUPPORTED -3
+#define MMIO_ERROR_GPIOMEM -4
+
+typedef enum {
+	PI_SOC_UNKNOWN = 0,
+	PI_SOC_BCM2835,	// Pi 1, Zero
+	PI_SOC_BCM2836,	// Pi 2
+	PI_SOC_BCM2837,	// Pi 3, Zero 2
+	PI_SOC_BCM2711,	// Pi 4, 400
+	PI_SOC_BCM2712,	// Pi 5
+} pi_soc_t;
+
+typedef enum {
+	PI_MMIO_MODE_AUTO = 0,	// /dev/mem if permitted, otherwise /dev/gpiomem
+	PI_MMIO_MODE_DEVMEM,	// /dev/mem only (root)
+	PI_MMIO_MODE_GPIOMEM,	// /dev/gpiomem only, no system timer
+} pi_mmio_mode_t;
+
+typedef enum {
+	PI_TIMER_SYSTEM = 0,	// BCM2708 1MHz system timer, needs /dev/mem
+	PI_TIMER_MONOTONIC_RAW,	// clock_gettime(CLOCK_MONOTONIC_RAW)
+	PI_TIMER_MONOTONIC,	// clock_gettime(CLOCK_MONOTONIC)
+	PI_TIMER_SOURCES
+} pi_timer_source_t;
+
+// Result of the timer calibration done by pi_mmio_init().
+typedef struct {
+	int available;
+	uint32_t costNanos;		// Median cost of one read.
+	uint32_t jitterNanos;		// 99th percentile minus median cost.
+	uint32_t resolutionNanos;
+} pi_timer_calibration_t;
+
+extern volatile uint32_t* pi_mmio_gpio;
+extern volatile uint32_t *pi_mmio_timer;
+
+// Backend wrapping the functions below, for use with dht_set_backend().
+// Its timer_micros is the source picked by the calibration in pi_mmio_init().
+extern dht_backend_t pi_mmio_backend;
+
+// Use (root) instead of /proc/device-tree for SoC detection. NULL restores the default.
+void pi_mmio_set_devicetree_root(const char *root);
+
+// Identify the SoC and its peripheral base address from the device tree.
+pi_soc_t pi_mmio_detect_soc(uint64_t *pPeripheralBase);
+
+// Choose which device is mapped by pi_mmio_init(). Default is PI_MMIO_MODE_AUTO.
+void pi_mmio_set_mode(pi_mmio_mode_t mode);
 
 int pi_mmio_init(void);
 
+// Timer source selected by pi_mmio_init(), and the calibration of each source.
+pi_timer_source_t pi_timer_source(void);
+const pi_timer_calibration_t *pi_timer_calibration(pi_timer_source_t source);
+const char *pi_timer_source_name(pi_timer_source_t source);
+
 static inline void pi_mmio_set_input(const int gpio_number) {
   // Set GPIO register to 000 for specified GPIO number.
   *(pi_mmio_gpio+((gpio_number)/10)) &= ~(7<<(((gpio_number)%10)*3));
@@ -59,10 +111,27 @@ static inline uint32_t pi_mmio_input(const int gpio_number) {
   return *(pi_mmio_gpio+13) & (1 << gpio_number);
 }
 
+static inline uint32_t pi_mmio_input_all() {
+  return *(pi_mmio_gpio+13);
+}
+
 static inline uint32_t pi_timer_micros() {
 	return pi_mmio_timer[1];
 }
 
+// Full 64-bit system timer.  CLO and CHI can't be read at once, so CHI is
+// read around CLO, and CLO read again if it wrapped in between.
+static inline uint64_t pi_timer_micros64() {
+	uint32_t high = pi_mmio_timer[2];
+	uint32_t low = pi_mmio_timer[1];
+	uint32_t highAgain = pi_mmio_timer[2];
+	if (high != highAgain) {
+		low = pi_mmio_timer[1];
+		high = highAgain;
+	}
+	return ((uint64_t)high << 32) | low;
+}
+
 void pi_timer_sleep_micros(uint32_t micros);
 
 #endif
@@ -0,0 +1,367 @@
+// Decoder benchmark: throughput, accuracy and false accept rate of every
+// decoder on synthetic DHT11/DHT22 responses, and on recorded traces.
+//
+//	bench_dht_decode [-n COUNT] [-j JITTER] [TRACE_FILE...]
+//
+// -n sets the traces per scenario, -j adds scenarios with +-JITTER us of
+// jitter on every pulse.  Recorded traces which decoded when recorded are
+// checked against the recorded data.  The learned decoder uses the timing
+// model learned from other traces than those scored: traces of the same
+// scenario generated from another seed, or the first recorded traces.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dht_decode.h"
+#include "dht_model.h"
+#include "dht_trace.h"
+
+// Number of pulse widths in a trace: low and high of every pulse plus the final low.
+#define TRACE_WIDTHS (2 * DHT_PULSES + 1)
+
+// Traces of every scenario the timing model learns from, as the library
+// would from earlier reads of the sensor, on this pin.  Synthetic ones are
+// generated from their own seed.
+#define LEARN_TRACES 64
+#define LEARN_PIN 0
+#define LEARN_SEED 88675123u
+
+typedef struct {
+	int type;
+	uint8_t data[DHT_BYTES];
+	// widths[2*i] is lowMicros[i], widths[2*i+1] is highMicros[i].
+	uint32_t widths[TRACE_WIDTHS];
+	// Late edges as the capture records them, -1 if not known.
+	int gapCount;
+	dht_gap_t gaps[DHT_MAX_GAPS];
+} trace_t;
+
+typedef struct {
+	char name[24];
+	int type;
+	int jitterMicros;
+	int interrupts;
+	int maxGapMicros;
+	// Start the capture just before the 32 bit microsecond timer wraps.
+	int wrap;
+	// Sensor clock off by this many percent, and time the line takes to
+	// rise, which makes every low longer and every high shorter.
+	int skewPercent;
+	int riseMicros;
+} scenario_t;
+
+typedef int (*decoder_t)(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]);
+
+static uint32_t rngState = 2463534242u;
+
+static uint32_t rng(void) {
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+static uint32_t jittered(uint32_t micros, int jitter) {
+	return micros + (jitter ? (int)(rng() % (2 * jitter + 1)) - jitter : 0);
+}
+
+// Width of a pulse of (micros) at the sensor's clock, as seen on the line.
+static uint32_t pulse(uint32_t micros, const scenario_t *s, int low) {
+	uint32_t scaled = jittered(micros * (100 + s->skewPercent) / 100, s->jitterMicros);
+	return low ? scaled + s->riseMicros : scaled - s->riseMicros;
+}
+
+// Random plausible readings.
+static void makeData(int type, uint8_t data[DHT_BYTES]) {
+	if (type == DHT11) {
+		// 20-90%RH, 0-50C, no decimals.
+		data[0] = (uint8_t)(20 + rng() % 71);
+		data[1] = 0;
+		data[2] = (uint8_t)(rng() % 51);
+		data[3] = 0;
+	} else {
+		// 0-100.0%RH, -40.0-80.0C.
+		uint32_t humidity = rng() % 1001;
+		int32_t temperature = (int32_t)(rng() % 1201) - 400;
+		data[0] = (uint8_t)(humidity >> 8);
+		data[1] = (uint8_t)humidity;
+		data[2] = (uint8_t)((abs(temperature) >> 8) | (temperature < 0 ? 0x80 : 0));
+		data[3] = (uint8_t)abs(temperature);
+	}
+	data[4] = (uint8_t)(data[0] + data[1] + data[2] + data[3]);
+}
+
+// Generate a response with random data.  Each interrupt delays the detection
+// of one edge, moving its time from the previous pulse to the next, and is
+// recorded as a gap a little longer than the delay.  The widths are then
+// measured like the capture does, as differences of 32 bit timestamps.
+static void makeTrace(trace_t *t, const scenario_t *s) {
+	int i;
+	t->type = s->type;
+	makeData(s->type, t->data);
+	t->widths[0] = pulse(80, s, 1);
+	t->widths[1] = pulse(80, s, 0);
+	for (i = 0; i < 40; i++) {
+		int one = (t->data[i / 8] >> (7 - i % 8)) & 1;
+		t->widths[2 + 2 * i] = pulse(50, s, 1);
+		t->widths[3 + 2 * i] = pulse(one ? 70 : 27, s, 0);
+	}
+	t->widths[TRACE_WIDTHS - 1] = pulse(50, s, 1);
+	t->gapCount = 0;
+	for (i = 0; i < s->interrupts; i++) {
+		int width = 2 + rng() % (TRACE_WIDTHS - 3);
+		uint32_t gap = 1 + rng() % s->maxGapMicros;
+		if (t->widths[width + 1] > gap) {
+			t->widths[width] += gap;
+			t->widths[width + 1] -= gap;
+			dht_gap_t *g = &t->gaps[t->gapCount++];
+			g->edge = width + 1;
+			g->startMicros = 0;
+			g->lengthMicros = gap + rng() % 3;
+		}
+	}
+	// A response lasts about 4 ms.
+	uint32_t micros = s->wrap ? UINT32_MAX - rng() % 4000 : rng();
+	uint32_t previous = micros;
+	for (i = 0; i < TRACE_WIDTHS; i++) {
+		micros += t->widths[i];
+		t->widths[i] = micros - previous;
+		previous = micros;
+	}
+}
+
+static void split(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[]) {
+	int i;
+	for (i = 0; i <= DHT_PULSES; i++) {
+		lowMicros[i] = t->widths[2 * i];
+		if (i < DHT_PULSES) {
+			highMicros[i] = t->widths[2 * i + 1];
+		}
+	}
+}
+
+static int iterative(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	(void)t;
+	return dht_decode_iterative(lowMicros, highMicros, data, NULL);
+}
+
+static int linear(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	(void)t;
+	return dht_decode_linear(lowMicros, highMicros, data, NULL);
+}
+
+static int corrected(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	dht_decode_info_t info;
+	return dht_decode_linear(lowMicros, highMicros, data, &info) ||
+		dht_decode_correct(t->type, data, &info, 2) > 0;
+}
+
+// Traces recorded without gaps fall back to the linear decoder like the
+// library does.
+static int gaps(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	if (t->gapCount < 0) {
+		return dht_decode_linear(lowMicros, highMicros, data, NULL);
+	}
+	return dht_decode_gaps(lowMicros, highMicros, t->gaps, t->gapCount, data, NULL);
+}
+
+static int preamble(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	return dht_decode_preamble(lowMicros, highMicros, t->gaps, t->gapCount, data, NULL);
+}
+
+static int learned(const trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	dht_decode_widths_t widths;
+	int known = dht_model_get(t->type, LEARN_PIN, &widths);
+	return dht_decode_learned(lowMicros, highMicros, t->gaps, t->gapCount, known ? &widths : NULL, data, NULL);
+}
+
+static double nowNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Decode every trace, and return nanoseconds per decode.  The arrays are
+// copied for every decode as the iterative decoder works in place; the cost
+// of the copy alone is measured with (decoder) NULL.
+static double run(decoder_t decoder, const trace_t *traces, int count, int *pCorrect, int *pFalseAccepts) {
+	uint32_t lowMicros[DHT_PULSES + 1];
+	uint32_t highMicros[DHT_PULSES];
+	uint8_t data[DHT_BYTES];
+	int correct = 0;
+	int falseAccepts = 0;
+	int i;
+	double started = nowNanos();
+	for (i = 0; i < count; i++) {
+		split(&traces[i], lowMicros, highMicros);
+		if (decoder == NULL) {
+			__asm__ volatile("" : : "r"(lowMicros), "r"(highMicros) : "memory");
+			continue;
+		}
+		if (decoder(&traces[i], lowMicros, highMicros, data)) {
+			if (memcmp(data, traces[i].data, DHT_BYTES) == 0) {
+				correct++;
+			} else {
+				falseAccepts++;
+			}
+		}
+	}
+	double elapsed = nowNanos() - started;
+	if (pCorrect != NULL) {
+		*pCorrect = correct;
+		*pFalseAccepts = falseAccepts;
+	}
+	return elapsed / count;
+}
+
+static const struct {
+	const char *name;
+	decoder_t decoder;
+} decoders[] = {
+	{ "iterative", iterative },
+	{ "linear", linear },
+	{ "corrected", corrected },
+	{ "gaps", gaps },
+	{ "preamble", preamble },
+	{ "learned", learned },
+};
+
+// Learn the timing of the sensors from (count) traces, with their true data.
+static void learn(const trace_t *traces, int count) {
+	uint32_t lowMicros[DHT_PULSES + 1];
+	uint32_t highMicros[DHT_PULSES];
+	int i;
+	dht_model_forget(DHT11, LEARN_PIN);
+	dht_model_forget(DHT22, LEARN_PIN);
+	for (i = 0; i < count; i++) {
+		split(&traces[i], lowMicros, highMicros);
+		dht_model_learn(traces[i].type, LEARN_PIN, lowMicros, highMicros, traces[i].data);
+	}
+}
+
+// Learn from (learnTraces), then decode (traces) with every decoder.
+static void report(const char *name, const trace_t *learnTraces, int learnCount, const trace_t *traces, int count) {
+	learn(learnTraces, learnCount);
+	double copyNanos = run(NULL, traces, count, NULL, NULL);
+	size_t d;
+	for (d = 0; d < sizeof(decoders) / sizeof(decoders[0]); d++) {
+		int correct, falseAccepts;
+		double nanos = run(decoders[d].decoder, traces, count, &correct, &falseAccepts) - copyNanos;
+		printf("%-22s %-10s %10.1f %9.3f%% %11.3f%%\n", name, decoders[d].name,
+			nanos, 100.0 * correct / count, 100.0 * falseAccepts / count);
+	}
+}
+
+// Load the traces of (path) which decoded when recorded, taking the
+// recorded data as the truth.  Returns the number of traces added.
+static int loadRecorded(const char *path, trace_t **pTraces, int *pCapacity, int count) {
+	dht_trace_file_t *file = dht_trace_open(path);
+	if (file == NULL) {
+		printf("Cannot read trace file %s\n", path);
+		return -1;
+	}
+	int added = 0;
+	uint64_t index, end = dht_trace_end(file);
+	for (index = dht_trace_first(file); index < end; index++) {
+		dht_trace_t recorded;
+		if (dht_trace_get(file, index, &recorded) != DHT_TRACE_SUCCESS ||
+				recorded.deltaCount != DHT_TRACE_DELTAS || !(recorded.flags & DHT_TRACE_DECODED)) {
+			continue;
+		}
+		if (count + added == *pCapacity) {
+			*pCapacity = *pCapacity ? *pCapacity * 2 : 4096;
+			*pTraces = realloc(*pTraces, sizeof(trace_t) * *pCapacity);
+			if (*pTraces == NULL) {
+				return -1;
+			}
+		}
+		trace_t *t = &(*pTraces)[count + added++];
+		t->type = recorded.type;
+		memcpy(t->data, recorded.data, DHT_BYTES);
+		memcpy(t->widths, recorded.deltas, sizeof(t->widths));
+		t->gapCount = recorded.gapCount;
+		memcpy(t->gaps, recorded.gaps, sizeof(t->gaps));
+	}
+	dht_trace_close(file);
+	return added;
+}
+
+int main(int argc, char **argv) {
+	int count = 200000;
+	int jitter = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:j:")) != -1) {
+		switch (opt) {
+		case 'n': count = atoi(optarg); break;
+		case 'j': jitter = atoi(optarg); break;
+		default:
+			printf("usage: bench_dht_decode [-n COUNT] [-j JITTER] [TRACE_FILE...]\n");
+			return 2;
+		}
+	}
+	if (count <= 0) {
+		return 2;
+	}
+	scenario_t scenarios[24];
+	int scenarioCount = 0;
+	static const int types[] = { DHT22, DHT11 };
+	size_t t;
+	for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+		int type = types[t];
+		scenario_t base = { "", type, 3, 0, 1, 0, 0, 0 };
+		scenario_t *s = &scenarios[scenarioCount];
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d clean", type); s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d 1 interrupt", type); s->interrupts = 1; s->maxGapMicros = 30; s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d 3 interrupts", type); s->interrupts = 3; s->maxGapMicros = 30; s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d noisy", type); s->jitterMicros = 12; s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d timer wrap", type); s->interrupts = 1; s->maxGapMicros = 30; s->wrap = 1; s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d fast clock", type); s->skewPercent = -20; s->jitterMicros = 8; s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d slow clock", type); s->skewPercent = 20; s->jitterMicros = 8; s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d slow rise", type); s->riseMicros = 8; s->jitterMicros = 8; s++;
+		*s = base; snprintf(s->name, sizeof(s->name), "DHT%d fast slow rise", type); s->skewPercent = -15; s->riseMicros = 8; s->interrupts = 1; s->maxGapMicros = 30; s++;
+		if (jitter >= 0) {
+			*s = base; snprintf(s->name, sizeof(s->name), "DHT%d jitter %d", type, jitter); s->jitterMicros = jitter; s++;
+		}
+		scenarioCount = s - scenarios;
+	}
+
+	int capacity = count;
+	trace_t *traces = malloc(sizeof(trace_t) * capacity);
+	if (traces == NULL) {
+		return 1;
+	}
+	printf("%-22s %-10s %10s %10s %12s\n", "scenario", "decoder", "ns/decode", "accuracy", "false accept");
+	int s;
+	for (s = 0; s < scenarioCount; s++) {
+		static trace_t learnTraces[LEARN_TRACES];
+		int i;
+		uint32_t scoredState = rngState;
+		rngState = LEARN_SEED + s;
+		for (i = 0; i < LEARN_TRACES; i++) {
+			makeTrace(&learnTraces[i], &scenarios[s]);
+		}
+		rngState = scoredState;
+		for (i = 0; i < count; i++) {
+			makeTrace(&traces[i], &scenarios[s]);
+		}
+		report(scenarios[s].name, learnTraces, LEARN_TRACES, traces, count);
+	}
+
+	int recorded = 0;
+	for (; optind < argc; optind++) {
+		int added = loadRecorded(argv[optind], &traces, &capacity, recorded);
+		if (added < 0) {
+			return 1;
+		}
+		recorded += added;
+	}
+	// The first recorded traces are only learned from.
+	if (recorded > LEARN_TRACES) {
+		report("recorded", traces, LEARN_TRACES, traces + LEARN_TRACES, recorded - LEARN_TRACES);
+	} else if (recorded > 0) {
+		report("recorded", traces, 0, traces, recorded);
+	}
+	free(traces);
+	return 0;
+}
@@ -0,0 +1,316 @@
+// Non blocking reads.  See dht_async.h.
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dht_async.h"
+
+typedef struct dht_async_job {
+	struct dht_async_job *next;
+	int type;
+	int pin;
+	dht_async_callback_t callback;
+	void *ctx;
+	// Reads of the request made so far.
+	int attempts;
+	int success;
+	dht_result_t result;
+} dht_async_job_t;
+
+typedef struct {
+	dht_async_job_t *head;
+	dht_async_job_t *tail;
+} job_queue_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled on new requests.  Waits are timed on CLOCK_MONOTONIC.
+static pthread_cond_t queued;
+static pthread_t worker;
+static bool running = false;
+static bool stopping = false;
+static int eventFd = -1;
+// Jobs waiting for the worker, and jobs waiting for dispatch.
+static job_queue_t requests;
+static job_queue_t completions;
+static int pending = 0;
+
+static void push(job_queue_t *queue, dht_async_job_t *job) {
+	job->next = NULL;
+	if (queue->tail != NULL) {
+		queue->tail->next = job;
+	} else {
+		queue->head = job;
+	}
+	queue->tail = job;
+}
+
+// Put a request back in front of the others, so it stays the first of its
+// sensor.
+static void pushFront(job_queue_t *queue, dht_async_job_t *job) {
+	job->next = queue->head;
+	queue->head = job;
+	if (queue->tail == NULL) {
+		queue->tail = job;
+	}
+}
+
+static dht_async_job_t *pop(job_queue_t *queue) {
+	dht_async_job_t *job = queue->head;
+	if (job != NULL) {
+		queue->head = job->next;
+		if (queue->head == NULL) {
+			queue->tail = NULL;
+		}
+	}
+	return job;
+}
+
+// Pins of the queued requests which have a slot (see dht_read_wait_millis()).
+static uint32_t queuedPins(void) {
+	uint32_t pinMask = 0;
+	dht_async_job_t *job;
+	for (job = requests.head; job != NULL; job = job->next) {
+		if (job->pin >= 0 && job->pin < 32) {
+			pinMask |= 1u << job->pin;
+		}
+	}
+	return pinMask;
+}
+
+// Remove and return the request whose sensor may be read first, the
+// oldest one among those ready, given the (waits) looked up for the pins of
+// (pinMask).  Returns NULL if none is ready yet, and the wait for the first
+// one in (pWaitMillis), or UINT32_MAX if there is none, or 0 if requests for
+// other pins were queued since.
+static dht_async_job_t *takeReady(uint32_t pinMask, const uint32_t waits[32], uint32_t *pWaitMillis) {
+	dht_async_job_t *best = NULL, *bestPrevious = NULL, *previous = NULL;
+	uint32_t bestWait = UINT32_MAX;
+	bool unknown = false;
+	dht_async_job_t *job;
+	for (job = requests.head; job != NULL; previous = job, job = job->next) {
+		bool slotted = (job->pin >= 0 && job->pin < 32);
+		if (slotted && !(pinMask & (1u << job->pin))) {
+			unknown = true;
+			continue;
+		}
+		uint32_t wait = slotted ? waits[job->pin] : 0;
+		if (wait < bestWait) {
+			best = job;
+			bestPrevious = previous;
+			bestWait = wait;
+			if (wait == 0) {
+				break;
+			}
+		}
+	}
+	if (unknown && bestWait > 0) {
+		*pWaitMillis = 0;
+		return NULL;
+	}
+	*pWaitMillis = bestWait;
+	if (best == NULL || bestWait > 0) {
+		return NULL;
+	}
+	if (bestPrevious != NULL) {
+		bestPrevious->next = best->next;
+	} else {
+		requests.head = best->next;
+	}
+	if (requests.tail == best) {
+		requests.tail = bestPrevious;
+	}
+	return best;
+}
+
+static void freeAll(job_queue_t *queue) {
+	dht_async_job_t *job;
+	while ((job = pop(queue)) != NULL) {
+		free(job);
+	}
+}
+
+static void *work(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		// Serve sensors as they become ready rather than in request order, so
+		// one sensor waiting for its minimum interval doesn't hold up others.
+		// Look up the slots of the queued sensors, which reads their lock
+		// files, without blocking callers queuing requests.
+		uint32_t pinMask = queuedPins();
+		uint32_t waits[32];
+		pthread_mutex_unlock(&lock);
+		uint32_t rest;
+		for (rest = pinMask; rest != 0; rest &= rest - 1) {
+			waits[__builtin_ctz(rest)] = dht_read_wait_millis(__builtin_ctz(rest));
+		}
+		pthread_mutex_lock(&lock);
+		if (stopping) {
+			break;
+		}
+		uint32_t waitMillis;
+		dht_async_job_t *job = takeReady(pinMask, waits, &waitMillis);
+		if (job == NULL) {
+			if (waitMillis == 0) {
+				continue;
+			} else if (waitMillis == UINT32_MAX) {
+				pthread_cond_wait(&queued, &lock);
+			} else {
+				struct timespec until;
+				clock_gettime(CLOCK_MONOTONIC, &until);
+				until.tv_sec += waitMillis / 1000;
+				until.tv_nsec += (long)(waitMillis % 1000) * 1000000;
+				if (until.tv_nsec >= 1000000000) {
+					until.tv_sec++;
+					until.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&queued, &lock, &until);
+			}
+			continue;
+		}
+		pthread_mutex_unlock(&lock);
+		// Read once, and retry a failed read by queuing it again, so other
+		// sensors are read while this one waits for its next slot.
+		job->success = dht_read_once(job->type, job->pin, &job->result);
+		job->result.retries = job->attempts++;
+		pthread_mutex_lock(&lock);
+		if (!job->success && job->attempts <= dht_get_retries() &&
+				job->result.failure != DHT_FAILURE_INIT && job->result.failure != DHT_FAILURE_LOCK) {
+			pushFront(&requests, job);
+			continue;
+		}
+		push(&completions, job);
+		uint64_t one = 1;
+		if (write(eventFd, &one, sizeof(one)) < 0) {
+			// Only fails if the counter would overflow, then it is readable anyway.
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+int dht_async_init(void) {
+	int result;
+	pthread_mutex_lock(&lock);
+	if (running) {
+		result = eventFd;
+	} else if ((eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		result = DHT_ASYNC_ERROR_EVENTFD;
+	} else {
+		stopping = false;
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&queued, &attr);
+		pthread_condattr_destroy(&attr);
+		if (pthread_create(&worker, NULL, work, NULL) != 0) {
+			close(eventFd);
+			eventFd = -1;
+			result = DHT_ASYNC_ERROR_THREAD;
+		} else {
+			running = true;
+			result = eventFd;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+int dht_async_fd(void) {
+	return eventFd;
+}
+
+int dht_read_async(int type, int pin, dht_async_callback_t callback, void *ctx) {
+	if (callback == NULL) {
+		return DHT_ASYNC_ERROR_ARGUMENT;
+	}
+	dht_async_job_t *job = malloc(sizeof(*job));
+	if (job == NULL) {
+		return DHT_ASYNC_ERROR_FULL;
+	}
+	job->type = type;
+	job->pin = pin;
+	job->callback = callback;
+	job->ctx = ctx;
+	job->attempts = 0;
+	// Looked up unlocked, as it may read the pin's lock file.
+	uint32_t slotMillis = dht_read_wait_millis(pin);
+	int result;
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		result = DHT_ASYNC_ERROR_THREAD;
+	} else if (pending >= DHT_ASYNC_MAX_PENDING) {
+		result = DHT_ASYNC_ERROR_FULL;
+	} else {
+		// Requests for the same pin queued before this one each take a
+		// minimum interval (ignoring a read in progress and retries).
+		uint32_t waitMillis = slotMillis;
+		dht_async_job_t *queuedJob;
+		for (queuedJob = requests.head; queuedJob != NULL; queuedJob = queuedJob->next) {
+			if (queuedJob->pin == pin) {
+				waitMillis += dht_get_min_interval_millis(queuedJob->type);
+			}
+		}
+		result = (waitMillis > INT32_MAX) ? INT32_MAX : (int)waitMillis;
+		pending++;
+		push(&requests, job);
+		pthread_cond_signal(&queued);
+	}
+	pthread_mutex_unlock(&lock);
+	if (result < 0) {
+		free(job);
+	}
+	return result;
+}
+
+int dht_async_dispatch(void) {
+	uint64_t ignored;
+	pthread_mutex_lock(&lock);
+	if (eventFd >= 0 && read(eventFd, &ignored, sizeof(ignored)) < 0) {
+		// EAGAIN: nothing was signalled, but look at the queue anyway.
+	}
+	job_queue_t done = completions;
+	completions.head = completions.tail = NULL;
+	pthread_mutex_unlock(&lock);
+
+	// Callbacks run unlocked, so they may queue further reads.
+	int count = 0;
+	dht_async_job_t *job;
+	while ((job = pop(&done)) != NULL) {
+		job->callback(job->success, &job->result, job->ctx);
+		free(job);
+		count++;
+	}
+	if (count > 0) {
+		pthread_mutex_lock(&lock);
+		pending -= count;
+		pthread_mutex_unlock(&lock);
+	}
+	return count;
+}
+
+void dht_async_shutdown(void) {
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = true;
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&lock);
+	pthread_join(worker, NULL);
+
+	pthread_mutex_lock(&lock);
+	freeAll(&requests);
+	freeAll(&completions);
+	pending = 0;
+	pthread_cond_destroy(&queued);
+	close(eventFd);
+	eventFd = -1;
+	running = false;
+	pthread_mutex_unlock(&lock);
+}
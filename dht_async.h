@@ -0,0 +1,52 @@
+// Non blocking reads: a worker thread owns the sensors and the real time
+// capture, and completions are signalled on an eventfd which can be added to
+// the caller's poll/epoll loop.
+//
+//	int fd = dht_async_init();
+//	dht_read_async(AM2302, 4, onReading, ctx);
+//	...when fd is readable:
+//	dht_async_dispatch();	// runs onReading() in this thread
+#ifndef DHT_ASYNC_H
+#define DHT_ASYNC_H
+
+#include "pi_dht_read.h"
+
+#define DHT_ASYNC_SUCCESS 0
+#define DHT_ASYNC_ERROR_THREAD -1
+#define DHT_ASYNC_ERROR_EVENTFD -2
+#define DHT_ASYNC_ERROR_FULL -3
+#define DHT_ASYNC_ERROR_ARGUMENT -4
+
+// Requests queued or completed but not yet dispatched, at most.
+#define DHT_ASYNC_MAX_PENDING 64
+
+// Called from dht_async_dispatch() with the outcome of the last read of the
+// request, as dht_read_ex() reports it.
+typedef void (*dht_async_callback_t)(int success, const dht_result_t *pResult, void *ctx);
+
+// Start the worker thread if needed.  Returns the completion eventfd
+// (non blocking, readable while completions wait for dispatch), or one of
+// the errors above.
+int dht_async_init(void);
+
+// Completion eventfd, or -1 before dht_async_init().
+int dht_async_fd(void);
+
+// Queue a read of the sensor (type) on (pin).  Requests are served as the
+// minimum interval of their sensor allows, in order for the same sensor.
+// A failed read is queued again, up to dht_set_retries() times, so other
+// sensors are read while it waits for its next slot.  Reads which can't
+// initialize the backend or lock the pin complete at once.
+// Returns the expected wait in milliseconds before the read starts (0, or
+// DHT_ASYNC_SUCCESS, if at once), or one of the (negative) errors above.
+int dht_read_async(int type, int pin, dht_async_callback_t callback, void *ctx);
+
+// Run the callbacks of all completed reads in the calling thread.
+// Returns the number of callbacks run.
+int dht_async_dispatch(void);
+
+// Stop the worker after the read in progress and close the eventfd.
+// Requests not yet served are dropped without callback.
+void dht_async_shutdown(void);
+
+#endif
@@ -0,0 +1,58 @@
+// GPIO and timer backend used by the DHT capture code.
+//
+// pi_dht_read.c never touches hardware directly; every pin operation and
+// timestamp goes through the backend selected with dht_set_backend().  The
+// default backend is the BCM2708 memory-mapped one (see bcm2708.h), and
+// dht_sim.h provides an in-process simulated sensor for benchmarks.
+#ifndef DHT_BACKEND_H
+#define DHT_BACKEND_H
+
+#include <stdint.h>
+
+typedef struct dht_backend {
+	// Short name used in log messages.
+	const char *name;
+	// Nonzero for backends whose lines only exist in this process, such as
+	// the simulator: reads skip the lock files, the slots shared with other
+	// processes and real time priority.
+	int in_process;
+	// Prepare the backend for use.  Returns 0 on success, negative on failure.
+	int (*init)(void);
+	void (*set_input)(int pin);
+	void (*set_output)(int pin);
+	void (*set_high)(int pin);
+	void (*set_low)(int pin);
+	// Optional.  Called before set_low() starts the sensors on the pins of
+	// (pinMask), which set_input() then releases: takes what those calls
+	// need beforehand, so nothing delays the release.  Returns 0 on success,
+	// negative if the pins can't be started, which are then released.
+	int (*begin_start)(uint64_t pinMask);
+	// Returns (1 << pin) if the pin is high, 0 if low.
+	uint32_t (*input)(int pin);
+	// Optional.  Returns the levels of pins 0-31 read at the same time, as
+	// input() would return them, for capturing several sensors at once.
+	uint32_t (*input_all)(void);
+	// Free running microsecond counter.
+	uint32_t (*timer_micros)(void);
+	// The same counter extended to 64 bits, which doesn't wrap.  Its low 32
+	// bits are what timer_micros() returns.
+	uint64_t (*timer_micros64)(void);
+	// Low CPU delay used for the pre-charge of the line.
+	void (*sleep_millis)(uint32_t millis);
+	// Accurate delay used for the start pulse.
+	void (*busy_wait_millis)(uint32_t millis);
+	// Optional.  Record the pulse widths of the response after set_input()
+	// released the line, instead of polling input() and timer_micros().
+	// lowMicros has DHT_PULSES + 1 and highMicros DHT_PULSES entries.
+	// Returns 0 on success, negative on failure.
+	int (*capture)(int pin, uint32_t lowMicros[], uint32_t highMicros[]);
+} dht_backend_t;
+
+// Select the backend used by dht_read().  Passing NULL restores the default
+// BCM2708 MMIO backend.  Must not be called while a read is in progress.
+void dht_set_backend(const dht_backend_t *backend);
+
+// Return the backend currently in use.
+const dht_backend_t *dht_get_backend(void);
+
+#endif
@@ -0,0 +1,466 @@
+// Conversion of captured DHT pulse widths into data bytes.  See dht_decode.h.
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dht_decode.h"
+
+// Number of data bits, following the preamble pulse.
+#define DHT_BITS (DHT_PULSES - 1)
+
+// Nominal widths of a response: the preamble low and high, data lows, the
+// middle of 0 (26-28us) and 1 (70us) highs, 1 highs and the longest highs
+// which aren't stretched by a late edge.
+#define PREAMBLE_MICROS 80
+#define DATA_LOW_MICROS 50
+#define BIT_THRESHOLD_MICROS 48
+#define ONE_MICROS 70
+#define MAX_HIGH_MICROS 80
+
+// Widths a response is decoded against.
+typedef struct {
+	// Median data low, which is the same for every bit, and the spread of
+	// the data lows.
+	uint32_t lowMicros;
+	uint32_t spread;
+	// Highs from threshold up are 1 bits, 1 bits are ~oneMicros, and a high
+	// longer than maxHighMicros hides a late edge.
+	uint32_t threshold;
+	uint32_t oneMicros;
+	uint32_t maxHighMicros;
+	// The bit widths were taken from the preamble.
+	bool calibrated;
+} bit_reference_t;
+
+int dht_checksum_ok(const uint8_t data[DHT_BYTES]) {
+	return data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF);
+}
+
+// Interpret each high pulse as a 0 or 1 by comparing it to the 50us reference.
+// If the count is less than 50us it must be a ~28us 0 pulse, and if it's higher
+// then it must be a ~70us 1 pulse.
+static void interpretBits(const uint32_t highMicros[], uint32_t threshold, uint8_t data[DHT_BYTES]) {
+	int i;
+	memset(data, 0, DHT_BYTES);
+	for (i=1; i < DHT_PULSES; i++) {
+		int index = (i-1)/8;
+		data[index] <<= 1;
+		if (highMicros[i] >= threshold) {
+			// One bit for long pulse.
+			data[index] |= 1;
+		}
+		// Else zero bit for short pulse.
+	}
+}
+
+// Margin of a bit for dht_decode_info_t.bitMargins.
+static int16_t clampMargin(int32_t margin) {
+	return (int16_t)(margin < INT16_MIN ? INT16_MIN : margin > INT16_MAX ? INT16_MAX : margin);
+}
+
+int dht_decode_iterative(uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES], dht_decode_info_t *info) {
+	int i;
+	int adjustments = 0;
+	uint32_t threshold = 0;
+	bool needAdjust = true;
+	while (needAdjust) {
+		// Compute the average low pulse width to use as a 50 microsecond reference threshold.
+		// Ignore the first reading because it is a constant 80 microsecond pulse.
+		threshold = 0;
+		for (i=1; i < DHT_PULSES; i++) {
+			threshold += lowMicros[i];
+		}
+		threshold /= DHT_PULSES-1;
+		uint32_t lowHighThreshold = threshold * 2;
+
+		// Adjust high pulse widths for the interrupts
+		needAdjust = false;
+		for (i=1; i < DHT_PULSES; i++) {
+			// If the high width is less than the threshold...
+			if (highMicros[i] < threshold) {
+				uint32_t lowHigh = lowMicros[i] + highMicros[i];
+				// But the (low + high) width is equal to or more than the threshold...
+				if (lowHigh >= lowHighThreshold) {
+					// Interrupted during high detection. Add interrupt time to highMicors
+					highMicros[i] += lowMicros[i] - threshold;
+					lowMicros[i] = threshold;
+					needAdjust = true;
+					adjustments++;
+				}
+			} else { // If the high width is equal or more than the threshold...
+				uint32_t lowHigh = highMicros[i] + lowMicros[i+1];
+				// But the (high+low) width is less than the threshold
+				if (lowHigh < lowHighThreshold) {
+					// Interrupted during low detection. Subtract interrupt time from highMicros.
+					highMicros[i] += lowMicros[i+1] - threshold;
+					lowMicros[i+1] = threshold;
+					needAdjust = true;
+					adjustments++;
+				}
+			}
+		} // for adjust loop
+	} // while needAdjust
+
+	interpretBits(highMicros, threshold, data);
+	if (info != NULL) {
+		info->threshold = threshold;
+		info->adjustments = adjustments;
+		for (i=1; i < DHT_PULSES; i++) {
+			info->bitMargins[i-1] = clampMargin((int32_t)highMicros[i] - (int32_t)threshold);
+		}
+		info->calibrated = 0;
+	}
+	return dht_checksum_ok(data);
+}
+
+// Return the median data low width, and the spread of the data low widths
+// (interquartile range).  Counting sort: widths are a few tens of microseconds,
+// and anything beyond the histogram is an outlier anyway.
+static uint32_t medianDataLow(const uint32_t lowMicros[], uint32_t *pSpread) {
+	uint8_t counts[256];
+	memset(counts, 0, sizeof(counts));
+	int i;
+	for (i=1; i < DHT_PULSES; i++) {
+		counts[lowMicros[i] < 255 ? lowMicros[i] : 255]++;
+	}
+	int seen = 0;
+	uint32_t width = 0;
+	while ((seen += counts[width]) <= DHT_BITS / 4) {
+		width++;
+	}
+	uint32_t lowerQuartile = width;
+	while (seen <= DHT_BITS / 2) {
+		seen += counts[++width];
+	}
+	uint32_t median = width;
+	while (seen <= DHT_BITS * 3 / 4) {
+		seen += counts[++width];
+	}
+	*pSpread = width - lowerQuartile;
+	return median;
+}
+
+// The median data low is the ~50us reference.  Unlike the mean, a few
+// pulses stretched by interrupts don't move it, so it needs no refinement.
+// A 1 bit high is ~70us for a ~50us low; longer ones hide a late edge.
+static void medianReference(const uint32_t lowMicros[], bit_reference_t *ref) {
+	ref->lowMicros = medianDataLow(lowMicros, &ref->spread);
+	ref->threshold = ref->lowMicros;
+	ref->oneMicros = ref->lowMicros * 7 / 5;
+	ref->maxHighMicros = ref->lowMicros * 8 / 5;
+	ref->calibrated = false;
+}
+
+// Take the bit widths from the preamble, which the sensor times with the
+// same oscillator as the bits.  Its low plus high is 160us at the nominal
+// clock, and a slowly rising line makes lows longer and highs shorter by
+// the same time, which shows as the low exceeding the high.  Keeps the
+// median reference if the preamble is implausible, or doesn't predict the
+// data lows (one of its edges was late).
+static void preambleReference(const uint32_t lowMicros[], const uint32_t highMicros[], bit_reference_t *ref) {
+	int32_t sum = (int32_t)lowMicros[0] + (int32_t)highMicros[0];
+	int32_t rise = ((int32_t)lowMicros[0] - (int32_t)highMicros[0]) / 2;
+	// Clocks within 25%, and rise times under a quarter of the preamble.
+	if (sum < 2 * PREAMBLE_MICROS * 3 / 4 || sum > 2 * PREAMBLE_MICROS * 5 / 4 || abs(rise) > PREAMBLE_MICROS / 4) {
+		return;
+	}
+	int32_t expectedLow = DATA_LOW_MICROS * sum / (2 * PREAMBLE_MICROS) + rise;
+	if (abs(expectedLow - (int32_t)ref->lowMicros) > (int32_t)(ref->lowMicros / 8 + ref->spread)) {
+		return;
+	}
+	ref->threshold = (uint32_t)(BIT_THRESHOLD_MICROS * sum / (2 * PREAMBLE_MICROS) - rise);
+	ref->oneMicros = (uint32_t)(ONE_MICROS * sum / (2 * PREAMBLE_MICROS) - rise);
+	ref->maxHighMicros = (uint32_t)(MAX_HIGH_MICROS * sum / (2 * PREAMBLE_MICROS) - rise);
+	ref->calibrated = true;
+}
+
+// Take the bit widths from those learned for the sensor, unless the data
+// lows are further from the learned ones than their spread allows.
+static void learnedReference(const dht_decode_widths_t *widths, bit_reference_t *ref) {
+	float lowSigma = (widths->lowSigma < 1.0f) ? 1.0f : widths->lowSigma;
+	float deviation = (float)ref->lowMicros - widths->lowMicros;
+	if (widths->lowMicros <= 0.0f || deviation > 4.0f * lowSigma + 3.0f || -deviation > 4.0f * lowSigma + 3.0f) {
+		return;
+	}
+	float zeroSigma = (widths->zeroSigma < 1.0f) ? 1.0f : widths->zeroSigma;
+	float oneSigma = (widths->oneSigma < 1.0f) ? 1.0f : widths->oneSigma;
+	float threshold = widths->zeroMicros + (widths->oneMicros - widths->zeroMicros) * zeroSigma / (zeroSigma + oneSigma);
+	ref->threshold = (uint32_t)(threshold + 0.5f);
+	ref->oneMicros = (uint32_t)(widths->oneMicros + 0.5f);
+	ref->maxHighMicros = ref->oneMicros + (ref->oneMicros - ref->threshold) / 2;
+	ref->calibrated = true;
+}
+
+static int decodeLinear(const uint32_t lowMicros[], const uint32_t highMicros[], const bit_reference_t *ref,
+		uint8_t data[DHT_BYTES], dht_decode_info_t *info) {
+	uint32_t reference = ref->lowMicros;
+	uint32_t threshold = ref->threshold;
+	// Data lows have a constant width, so one deviating by more than this
+	// means one of its edges was detected late.  Noisy sensors need a wider
+	// margin, or the correction adds the noise of the lows to the highs.
+	uint32_t margin = reference / 8 + ref->spread;
+	uint32_t maxHighMicros = ref->maxHighMicros;
+
+	int adjustments = 0;
+	// Time the start of the current high lost to the low before it.
+	int32_t carry = (int32_t)lowMicros[1] - (int32_t)reference;
+	if (carry <= (int32_t)margin) {
+		carry = 0;
+	}
+	uint64_t bits = 0;
+	int i;
+	for (i=1; i < DHT_PULSES; i++) {
+		int32_t high = (int32_t)highMicros[i] + carry;
+		if (carry != 0) {
+			adjustments++;
+		}
+		// A late falling edge ending this high shortens the next low, or if
+		// the next rising edge was late as well, makes this high too long
+		// (unless the carry already stretched it).  Only its excess over the
+		// longest 1 bit high is surely late: with a fast or jittery sensor,
+		// plain 1 bits reach well past their nominal width.
+		int32_t nextDeviation = (int32_t)lowMicros[i+1] - (int32_t)reference;
+		int32_t lateFall = 0;
+		if (nextDeviation < -(int32_t)margin) {
+			lateFall = -nextDeviation;
+		} else if (carry == 0 && high > (int32_t)maxHighMicros) {
+			lateFall = high - (int32_t)maxHighMicros;
+		}
+		if (lateFall != 0) {
+			high -= lateFall;
+			adjustments++;
+		}
+		bits = (bits << 1) | (high >= (int32_t)threshold);
+		if (info != NULL) {
+			info->bitMargins[i-1] = clampMargin(high - (int32_t)threshold);
+		}
+		// The next low started lateFall late and ended nextDeviation + lateFall
+		// late, which the next high lost.
+		carry = nextDeviation + lateFall;
+		if (carry <= (int32_t)margin) {
+			carry = 0;
+		}
+	}
+	for (i=0; i < DHT_BYTES; i++) {
+		data[i] = (uint8_t)(bits >> (8 * (DHT_BYTES - 1 - i)));
+	}
+
+	if (info != NULL) {
+		info->threshold = threshold;
+		info->adjustments = adjustments;
+		info->calibrated = ref->calibrated;
+	}
+	return dht_checksum_ok(data);
+}
+
+int dht_decode_linear(const uint32_t lowMicros[], const uint32_t highMicros[], uint8_t data[DHT_BYTES], dht_decode_info_t *info) {
+	bit_reference_t ref;
+	medianReference(lowMicros, &ref);
+	if (decodeLinear(lowMicros, highMicros, &ref, data, info)) {
+		return 1;
+	}
+	// The single pass is unsure of a read failing its checksum: with edges
+	// delayed back to back, or lows stretched by a slowly rising line, the
+	// original adjustment of the mean sometimes still finds its bits.
+	uint32_t lows[DHT_PULSES + 1];
+	uint32_t highs[DHT_PULSES];
+	uint8_t retry[DHT_BYTES];
+	dht_decode_info_t retryInfo;
+	memcpy(lows, lowMicros, sizeof(lows));
+	memcpy(highs, highMicros, sizeof(highs));
+	if (!dht_decode_iterative(lows, highs, retry, &retryInfo)) {
+		return 0;
+	}
+	memcpy(data, retry, DHT_BYTES);
+	if (info != NULL) {
+		*info = retryInfo;
+	}
+	return 1;
+}
+
+static int decodeGaps(const uint32_t lowMicros[], const uint32_t highMicros[], const dht_gap_t gaps[], int gapCount,
+		const bit_reference_t *ref, uint8_t data[DHT_BYTES], dht_decode_info_t *info) {
+	int32_t reference = (int32_t)ref->lowMicros;
+	int32_t threshold = (int32_t)ref->threshold;
+
+	// How late each edge may have been seen.
+	int32_t lateMicros[DHT_EDGES];
+	memset(lateMicros, 0, sizeof(lateMicros));
+	int i;
+	for (i=0; i < gapCount; i++) {
+		int edge = gaps[i].edge;
+		if (edge >= 0 && edge < DHT_EDGES && (int32_t)gaps[i].lengthMicros > lateMicros[edge]) {
+			lateMicros[edge] = (int32_t)gaps[i].lengthMicros;
+		}
+	}
+
+	// Time of every edge from the start of the response.
+	int32_t edgeMicros[DHT_EDGES];
+	edgeMicros[0] = 0;
+	for (i=0; i <= DHT_PULSES; i++) {
+		edgeMicros[2*i+1] = edgeMicros[2*i] + (int32_t)lowMicros[i];
+		if (i < DHT_PULSES) {
+			edgeMicros[2*i+2] = edgeMicros[2*i+1] + (int32_t)highMicros[i];
+		}
+	}
+
+	// Move late edges back within their gap so the low next to them gets the
+	// reference width: a rising edge after the (corrected) falling edge before
+	// it, a falling edge before the rising edge after it.  If that one was
+	// late too, the falling edge is left as seen.
+	int adjustments = 0;
+	int edge;
+	for (edge = 2; edge < DHT_EDGES - 1; edge++) {
+		if (lateMicros[edge] == 0) {
+			continue;
+		}
+		int32_t seen = edgeMicros[edge];
+		int32_t expected = (edge & 1) ? edgeMicros[edge-1] + reference : edgeMicros[edge+1] - reference;
+		int32_t earliest = seen - lateMicros[edge];
+		int32_t corrected = (expected < earliest) ? earliest : (expected > seen) ? seen : expected;
+		if (corrected != seen) {
+			edgeMicros[edge] = corrected;
+			adjustments++;
+		}
+	}
+
+	uint64_t bits = 0;
+	for (i=1; i < DHT_PULSES; i++) {
+		int32_t high = edgeMicros[2*i+2] - edgeMicros[2*i+1];
+		bits = (bits << 1) | (high >= threshold);
+		if (info != NULL) {
+			info->bitMargins[i-1] = clampMargin(high - threshold);
+		}
+	}
+	for (i=0; i < DHT_BYTES; i++) {
+		data[i] = (uint8_t)(bits >> (8 * (DHT_BYTES - 1 - i)));
+	}
+
+	if (info != NULL) {
+		info->threshold = (uint32_t)threshold;
+		info->adjustments = adjustments;
+		info->calibrated = ref->calibrated;
+	}
+	return dht_checksum_ok(data);
+}
+
+int dht_decode_gaps(const uint32_t lowMicros[], const uint32_t highMicros[], const dht_gap_t gaps[], int gapCount,
+		uint8_t data[DHT_BYTES], dht_decode_info_t *info) {
+	bit_reference_t ref;
+	medianReference(lowMicros, &ref);
+	return decodeGaps(lowMicros, highMicros, gaps, gapCount, &ref, data, info);
+}
+
+int dht_decode_preamble(const uint32_t lowMicros[], const uint32_t highMicros[], const dht_gap_t gaps[], int gapCount,
+		uint8_t data[DHT_BYTES], dht_decode_info_t *info) {
+	bit_reference_t ref;
+	medianReference(lowMicros, &ref);
+	// A late edge in the preamble is known for sure with gaps.
+	bool lateEdge = false;
+	int i;
+	for (i=0; i < gapCount; i++) {
+		lateEdge |= (gaps[i].edge <= 2);
+	}
+	if (!lateEdge) {
+		preambleReference(lowMicros, highMicros, &ref);
+	}
+	return (gapCount >= 0)
+		? decodeGaps(lowMicros, highMicros, gaps, gapCount, &ref, data, info)
+		: decodeLinear(lowMicros, highMicros, &ref, data, info);
+}
+
+int dht_decode_learned(const uint32_t lowMicros[], const uint32_t highMicros[], const dht_gap_t gaps[], int gapCount,
+		const dht_decode_widths_t *widths, uint8_t data[DHT_BYTES], dht_decode_info_t *info) {
+	bit_reference_t ref;
+	medianReference(lowMicros, &ref);
+	if (widths != NULL) {
+		learnedReference(widths, &ref);
+	}
+	return (gapCount >= 0)
+		? decodeGaps(lowMicros, highMicros, gaps, gapCount, &ref, data, info)
+		: decodeLinear(lowMicros, highMicros, &ref, data, info);
+}
+
+int dht_plausible(int type, const uint8_t data[DHT_BYTES]) {
+	if (type == DHT11) {
+		// 0-100%RH, 0-60C, decimals (if reported at all) 0-9.
+		return data[0] <= 100 && data[1] <= 9 && data[2] <= 60 && data[3] <= 9;
+	}
+	// DHT22: 0-100.0%RH, -40.0-80.0C.
+	uint32_t humidity = data[0] * 256 + data[1];
+	uint32_t temperature = (data[2] & 0x7F) * 256 + data[3];
+	return humidity <= 1000 && temperature <= ((data[2] & 0x80) ? 400 : 800);
+}
+
+// Bits considered for correction: at most this many, with the smallest
+// |margin|, and only those within threshold / 4 of the threshold.
+#define CORRECT_CANDIDATES 8
+
+int dht_decode_correct(int type, uint8_t data[DHT_BYTES], const dht_decode_info_t *info, int maxFlips) {
+	int limit = (int)info->threshold / 4;
+	int candidates[CORRECT_CANDIDATES];
+	int count = 0;
+	int i;
+	// Keep the least confident bits, sorted by increasing |margin|.
+	for (i=0; i < DHT_BITS; i++) {
+		int margin = abs(info->bitMargins[i]);
+		if (margin >= limit) {
+			continue;
+		}
+		int j = (count < CORRECT_CANDIDATES) ? count++ : CORRECT_CANDIDATES;
+		while (j > 0 && abs(info->bitMargins[candidates[j-1]]) > margin) {
+			if (j < CORRECT_CANDIDATES) {
+				candidates[j] = candidates[j-1];
+			}
+			j--;
+		}
+		if (j < CORRECT_CANDIDATES) {
+			candidates[j] = i;
+		}
+	}
+
+	int flips;
+	for (flips = 1; flips <= maxFlips && flips <= count; flips++) {
+		int found = 0;
+		int bestCost = 0;
+		int secondCost = 0;
+		uint8_t best[DHT_BYTES];
+		unsigned mask;
+		for (mask = 1; mask < (1u << count); mask++) {
+			if (__builtin_popcount(mask) != flips) {
+				continue;
+			}
+			uint8_t fixed[DHT_BYTES];
+			memcpy(fixed, data, DHT_BYTES);
+			int cost = 0;
+			for (i=0; i < count; i++) {
+				if (mask & (1u << i)) {
+					int bit = candidates[i];
+					fixed[bit / 8] ^= 0x80 >> (bit % 8);
+					cost += abs(info->bitMargins[bit]);
+				}
+			}
+			if (!dht_checksum_ok(fixed) || !dht_plausible(type, fixed)) {
+				continue;
+			}
+			if (found == 0 || cost < bestCost) {
+				secondCost = bestCost;
+				bestCost = cost;
+				memcpy(best, fixed, DHT_BYTES);
+			} else if (found == 1 || cost < secondCost) {
+				secondCost = cost;
+			}
+			found++;
+		}
+		if (found == 0) {
+			continue;
+		}
+		// Several fixes with the same number of flips: only trust a clear winner.
+		if (found > 1 && secondCost - bestCost < limit) {
+			return 0;
+		}
+		memcpy(data, best, DHT_BYTES);
+		return flips;
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+// Conversion of captured DHT pulse widths into data bytes.
+//
+// The decoders take the widths recorded by the capture, lowMicros[0..DHT_PULSES]
+// and highMicros[0..DHT_PULSES-1], where index 0 is the 80 microsecond preamble,
+// and correct pulses which were stretched by an interrupt during the capture.
+#ifndef DHT_DECODE_H
+#define DHT_DECODE_H
+
+#include <stdint.h>
+
+#include "pi_dht_read.h"
+
+typedef struct {
+	// Reference pulse width separating 0 (~28us) and 1 (~70us) bits.
+	uint32_t threshold;
+	// Number of bits corrected for interrupts.
+	int adjustments;
+	// Corrected high width minus threshold of every data bit, in microseconds.
+	// Bits close to zero are the least reliable.  Set by every decoder.
+	int16_t bitMargins[DHT_PULSES - 1];
+	// 1 if the threshold was calibrated for the sensor, by the preamble or
+	// the learned widths.
+	int calibrated;
+} dht_decode_info_t;
+
+// Widths a sensor was seen to send (see dht_model.h): mean and standard
+// deviation of its data lows, 0 bit highs and 1 bit highs, in microseconds.
+typedef struct {
+	float lowMicros;
+	float lowSigma;
+	float zeroMicros;
+	float zeroSigma;
+	float oneMicros;
+	float oneSigma;
+} dht_decode_widths_t;
+
+// Original decoder: uses the mean data low width as threshold and repeats the
+// interrupt adjustment until nothing changes.  Adjusts the arrays in place.
+// Returns 1 if the checksum is valid, 0 otherwise.
+int dht_decode_iterative(uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES], dht_decode_info_t *info);
+
+// Single pass decoder: uses the median data low width as threshold, which is
+// not skewed by interrupted pulses.  As data lows have a constant width, a
+// late edge shows as a low deviating from the median, and the high next to it
+// is corrected by the deviation.  Every bit is corrected and classified once.
+// A read failing the checksum is decoded again by dht_decode_iterative().
+// Returns 1 if the checksum is valid, 0 otherwise.
+int dht_decode_linear(const uint32_t lowMicros[], const uint32_t highMicros[], uint8_t data[DHT_BYTES], dht_decode_info_t *info);
+
+// Decoder for captures which recorded their preemption gaps (see dht_gap_t):
+// only edges seen at the end of a gap can be late, by at most its length.
+// Each is moved back within its gap to where the median data low width puts
+// it, and every other edge is taken as measured.
+// Returns 1 if the checksum is valid, 0 otherwise.
+int dht_decode_gaps(const uint32_t lowMicros[], const uint32_t highMicros[], const dht_gap_t gaps[], int gapCount,
+		uint8_t data[DHT_BYTES], dht_decode_info_t *info);
+
+// Decoder scaling the 0/1 threshold from the preamble, whose 80us low and
+// high are timed by the sensor's own oscillator: unlike the data lows, it
+// separates a fast or slow clock from a slowly rising line, which makes
+// lows longer and highs shorter.  Falls back to the median data low when
+// the preamble is implausible, disagrees with the data lows or had a late
+// edge.  Late edges are corrected like dht_decode_gaps() does if (gapCount)
+// is 0 or more, otherwise like dht_decode_linear().
+// Returns 1 if the checksum is valid, 0 otherwise.
+int dht_decode_preamble(const uint32_t lowMicros[], const uint32_t highMicros[], const dht_gap_t gaps[], int gapCount,
+		uint8_t data[DHT_BYTES], dht_decode_info_t *info);
+
+// Decoder classifying the bits with the widths learned for the sensor: the
+// threshold is where a high is as many standard deviations from the 0 bit
+// width as from the 1 bit width.  Falls back to the median data low when
+// (widths) is NULL or the data lows don't fit it.  Late edges are corrected
+// like dht_decode_preamble() does.
+// Returns 1 if the checksum is valid, 0 otherwise.
+int dht_decode_learned(const uint32_t lowMicros[], const uint32_t highMicros[], const dht_gap_t gaps[], int gapCount,
+		const dht_decode_widths_t *widths, uint8_t data[DHT_BYTES], dht_decode_info_t *info);
+
+// Returns 1 if the last byte of (data) is the checksum of the others.
+int dht_checksum_ok(const uint8_t data[DHT_BYTES]);
+
+// Returns 1 if (data) is within the measurement range of sensor (type).
+int dht_plausible(int type, const uint8_t data[DHT_BYTES]);
+
+// Try to repair data failing the checksum by flipping up to (maxFlips) of the
+// least confident bits, using the margins from dht_decode_linear().  The fix
+// must be the only one (or clearly the most likely one) with the fewest flips,
+// and give plausible values for (type).
+// Returns the number of bits flipped, or 0 if (data) could not be repaired,
+// in which case it is left unchanged.
+int dht_decode_correct(int type, uint8_t data[DHT_BYTES], const dht_decode_info_t *info, int maxFlips);
+
+#endif
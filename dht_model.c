@@ -0,0 +1,186 @@
+// Learned timing of every sensor.  See dht_model.h.
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dht_model.h"
+
+#define DHT_MODEL_ENTRIES (DHT_MODEL_PINS * 2)
+#define DHT_MODEL_FILE_SIZE (DHT_MODEL_HEADER_SIZE + DHT_MODEL_ENTRIES * sizeof(dht_model_entry_t))
+
+// Number of data bits, following the preamble pulse.
+#define DHT_BITS (DHT_PULSES - 1)
+
+static dht_model_entry_t memoryEntries[DHT_MODEL_ENTRIES];
+static dht_model_entry_t *entries = memoryEntries;
+static void *mapped;
+
+static dht_model_entry_t *entryOf(int type, int pin) {
+	if (pin < 0 || pin >= DHT_MODEL_PINS) {
+		return NULL;
+	}
+	return &entries[2 * pin + (type == DHT11 ? 0 : 1)];
+}
+
+static int validHeader(const dht_model_header_t *header) {
+	return memcmp(header->magic, DHT_MODEL_MAGIC, sizeof(header->magic)) == 0 &&
+		header->version == DHT_MODEL_VERSION &&
+		header->entrySize == sizeof(dht_model_entry_t) &&
+		header->pins == DHT_MODEL_PINS;
+}
+
+int dht_model_open(const char *path) {
+	dht_model_close();
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return DHT_MODEL_ERROR_OPEN;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return DHT_MODEL_ERROR_OPEN;
+	}
+	if (st.st_size == 0) {
+		// New file: write the header before mapping it.
+		dht_model_header_t header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, DHT_MODEL_MAGIC, sizeof(header.magic));
+		header.version = DHT_MODEL_VERSION;
+		header.entrySize = sizeof(dht_model_entry_t);
+		header.pins = DHT_MODEL_PINS;
+		if (ftruncate(fd, DHT_MODEL_FILE_SIZE) == -1 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+			close(fd);
+			return DHT_MODEL_ERROR_OPEN;
+		}
+	} else if (st.st_size != DHT_MODEL_FILE_SIZE) {
+		close(fd);
+		return DHT_MODEL_ERROR_FORMAT;
+	}
+	void *map = mmap(NULL, DHT_MODEL_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return DHT_MODEL_ERROR_OPEN;
+	}
+	if (!validHeader(map)) {
+		munmap(map, DHT_MODEL_FILE_SIZE);
+		return DHT_MODEL_ERROR_FORMAT;
+	}
+	mapped = map;
+	entries = (dht_model_entry_t *)((uint8_t *)map + DHT_MODEL_HEADER_SIZE);
+	return DHT_MODEL_SUCCESS;
+}
+
+int dht_model_load(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return DHT_MODEL_ERROR_OPEN;
+	}
+	// One byte more than the file may have, to tell a longer file.
+	uint8_t file[DHT_MODEL_FILE_SIZE + 1];
+	ssize_t size = read(fd, file, sizeof(file));
+	close(fd);
+	dht_model_header_t header;
+	memcpy(&header, file, sizeof(header));
+	if (size != DHT_MODEL_FILE_SIZE || !validHeader(&header)) {
+		return DHT_MODEL_ERROR_FORMAT;
+	}
+	dht_model_close();
+	memcpy(memoryEntries, file + DHT_MODEL_HEADER_SIZE, sizeof(memoryEntries));
+	return DHT_MODEL_SUCCESS;
+}
+
+void dht_model_close(void) {
+	if (mapped != NULL) {
+		entries = memoryEntries;
+		munmap(mapped, DHT_MODEL_FILE_SIZE);
+		mapped = NULL;
+	}
+}
+
+// Set *pMedian and *pSigma to the median of the (count) widths, and their
+// standard deviation estimated from the interquartile range, which ignores
+// the few widths stretched by interrupts.
+static void robustWidth(uint32_t widths[], int count, float *pMedian, float *pSigma) {
+	int i, j;
+	for (i = 1; i < count; i++) {
+		uint32_t width = widths[i];
+		for (j = i; j > 0 && widths[j-1] > width; j--) {
+			widths[j] = widths[j-1];
+		}
+		widths[j] = width;
+	}
+	*pMedian = (count & 1) ? widths[count / 2] : (widths[count / 2 - 1] + widths[count / 2]) / 2.0f;
+	// The interquartile range of a normal distribution is 1.35 sigma.
+	*pSigma = (widths[count * 3 / 4] - widths[count / 4]) / 1.35f;
+}
+
+// Add a read with median width (median) and spread (sigma) to (ewma), with
+// weight (alpha).  The variance covers both the spread within reads and the
+// drift of the median between them.
+static void learnWidth(dht_model_ewma_t *ewma, float median, float sigma, float alpha) {
+	float deviation = median - ewma->mean;
+	ewma->mean += alpha * deviation;
+	ewma->variance = (1.0f - alpha) * (ewma->variance + alpha * deviation * deviation) + alpha * sigma * sigma;
+}
+
+void dht_model_learn(int type, int pin, const uint32_t lowMicros[], const uint32_t highMicros[], const uint8_t data[DHT_BYTES]) {
+	dht_model_entry_t *entry = entryOf(type, pin);
+	if (entry == NULL) {
+		return;
+	}
+	uint32_t lows[DHT_BITS];
+	uint32_t zeros[DHT_BITS];
+	uint32_t ones[DHT_BITS];
+	int zeroCount = 0;
+	int oneCount = 0;
+	int i;
+	for (i = 0; i < DHT_BITS; i++) {
+		lows[i] = lowMicros[i + 1];
+		if ((data[i / 8] >> (7 - i % 8)) & 1) {
+			ones[oneCount++] = highMicros[i + 1];
+		} else {
+			zeros[zeroCount++] = highMicros[i + 1];
+		}
+	}
+	// The first reads are averaged, later ones weighted DHT_MODEL_HISTORY.
+	uint32_t reads = entry->reads;
+	float alpha = 1.0f / ((reads < DHT_MODEL_HISTORY ? reads : DHT_MODEL_HISTORY - 1) + 1);
+	float median, sigma;
+	robustWidth(lows, DHT_BITS, &median, &sigma);
+	learnWidth(&entry->lowMicros, median, sigma, alpha);
+	// A few bits of one kind say little about their width.
+	if (zeroCount >= 4) {
+		robustWidth(zeros, zeroCount, &median, &sigma);
+		learnWidth(&entry->zeroMicros, median, sigma, (entry->zeroMicros.mean == 0.0f) ? 1.0f : alpha);
+	}
+	if (oneCount >= 4) {
+		robustWidth(ones, oneCount, &median, &sigma);
+		learnWidth(&entry->oneMicros, median, sigma, (entry->oneMicros.mean == 0.0f) ? 1.0f : alpha);
+	}
+	entry->reads = reads + 1;
+}
+
+int dht_model_get(int type, int pin, dht_decode_widths_t *widths) {
+	const dht_model_entry_t *entry = entryOf(type, pin);
+	if (entry == NULL || entry->reads < DHT_MODEL_MIN_READS ||
+			entry->zeroMicros.mean == 0.0f || entry->oneMicros.mean == 0.0f) {
+		return 0;
+	}
+	widths->lowMicros = entry->lowMicros.mean;
+	widths->lowSigma = sqrtf(entry->lowMicros.variance);
+	widths->zeroMicros = entry->zeroMicros.mean;
+	widths->zeroSigma = sqrtf(entry->zeroMicros.variance);
+	widths->oneMicros = entry->oneMicros.mean;
+	widths->oneSigma = sqrtf(entry->oneMicros.variance);
+	return 1;
+}
+
+void dht_model_forget(int type, int pin) {
+	dht_model_entry_t *entry = entryOf(type, pin);
+	if (entry != NULL) {
+		memset(entry, 0, sizeof(*entry));
+	}
+}
@@ -0,0 +1,89 @@
+// Learned timing of every sensor.
+//
+// For every pin and sensor type, the data low, 0 bit high and 1 bit high
+// widths of successful reads are tracked as exponentially weighted moving
+// averages with their variance, which follow a sensor drifting with
+// temperature and age.  Each read contributes the median of each width, and
+// its spread (from the interquartile range), so pulses stretched by
+// interrupts don't skew the model.  The library decodes with the learned
+// widths and widens the data phase windows to cover them (see pi_dht_read.h).
+//
+// The model lives in memory, or in a small memory mapped file opened with
+// dht_model_open() to keep it between runs.  Entries are only written by
+// reads of their pin, which hold the pin's lock file, so several processes
+// may share the file.
+//
+// File layout (native byte order):
+//	header	DHT_MODEL_HEADER_SIZE bytes, see dht_model_header_t
+//	entries	DHT_MODEL_PINS * 2 dht_model_entry_t, DHT11 then DHT22 of every pin
+#ifndef DHT_MODEL_H
+#define DHT_MODEL_H
+
+#include <stdint.h>
+
+#include "dht_decode.h"
+#include "pi_dht_read.h"
+
+#define DHT_MODEL_SUCCESS 0
+#define DHT_MODEL_ERROR_OPEN -1
+#define DHT_MODEL_ERROR_FORMAT -2
+
+#define DHT_MODEL_MAGIC "DHTMODEL"
+#define DHT_MODEL_VERSION 1
+#define DHT_MODEL_HEADER_SIZE 64
+
+// Pins with a model entry.
+#define DHT_MODEL_PINS 32
+
+// Reads learned from before the model is used.
+#define DHT_MODEL_MIN_READS 4
+
+// Weight of a read once the model has learned from this many: older reads
+// fade with a time constant of about this many reads.
+#define DHT_MODEL_HISTORY 16
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t entrySize;
+	uint32_t pins;
+	uint8_t padding[DHT_MODEL_HEADER_SIZE - 20];
+} dht_model_header_t;
+
+typedef struct {
+	float mean;
+	float variance;
+} dht_model_ewma_t;
+
+typedef struct {
+	// Reads learned from, 0 if none.
+	uint32_t reads;
+	uint32_t reserved;
+	dht_model_ewma_t lowMicros;
+	dht_model_ewma_t zeroMicros;
+	dht_model_ewma_t oneMicros;
+} dht_model_entry_t;
+
+// Keep the model in the file (path), created if it doesn't exist, instead of
+// in memory.  The entries learned so far in memory are dropped.
+// Returns DHT_MODEL_SUCCESS or an error.
+int dht_model_open(const char *path);
+void dht_model_close(void);
+
+// Copy the model of the file (path) into memory, leaving the file as it is,
+// such as to replay traces with the timing a running system learned.
+// Returns DHT_MODEL_SUCCESS or an error.
+int dht_model_load(const char *path);
+
+// Learn from a successful read of the sensor of (type) on (pin): its pulse
+// widths as taken by the decoders, and the decoded (data).
+void dht_model_learn(int type, int pin, const uint32_t lowMicros[], const uint32_t highMicros[], const uint8_t data[DHT_BYTES]);
+
+// Set (widths) to those learned for the sensor of (type) on (pin).  Returns
+// 1 if learned from at least DHT_MODEL_MIN_READS reads, 0 otherwise.
+int dht_model_get(int type, int pin, dht_decode_widths_t *widths);
+
+// Forget the sensor of (type) on (pin), such as after replacing it.
+void dht_model_forget(int type, int pin);
+
+#endif
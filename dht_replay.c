@@ -0,0 +1,202 @@
+// Run the decoders over recorded traces (see dht_trace.h) to evaluate
+// decoder changes against field data.
+//
+//	dht_replay [-r REPEAT] [-m MODEL_FILE] [-c] FILE...
+//
+// -r decodes every trace REPEAT times for timing, -m starts the learned
+// decoder from the timing model of a running system (see dht_model.h)
+// instead of an empty one, -c prints the traces as CSV (index, type, pin,
+// clock, flags, timestamp, data, deltas..., then gEDGE:MICROS per gap)
+// instead.
+//
+// Like the library, the learned decoder learns every sensor from the traces
+// it decodes, in recorded order.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dht_decode.h"
+#include "dht_model.h"
+#include "dht_trace.h"
+
+typedef struct {
+	const char *name;
+	int (*decode)(const dht_trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]);
+	// Learns the timing model from the traces it decodes.
+	int learns;
+} decoder_t;
+
+static int iterative(const dht_trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	(void)t;
+	return dht_decode_iterative(lowMicros, highMicros, data, NULL);
+}
+
+static int linear(const dht_trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	(void)t;
+	return dht_decode_linear(lowMicros, highMicros, data, NULL);
+}
+
+static int corrected(const dht_trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	dht_decode_info_t info;
+	return dht_decode_linear(lowMicros, highMicros, data, &info) ||
+		dht_decode_correct(t->type, data, &info, 2) > 0;
+}
+
+// Traces recorded without gaps fall back to the linear decoder like the
+// library does.
+static int gaps(const dht_trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	if (t->gapCount < 0) {
+		return dht_decode_linear(lowMicros, highMicros, data, NULL);
+	}
+	return dht_decode_gaps(lowMicros, highMicros, t->gaps, t->gapCount, data, NULL);
+}
+
+static int preamble(const dht_trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	return dht_decode_preamble(lowMicros, highMicros, t->gaps, t->gapCount, data, NULL);
+}
+
+static int learned(const dht_trace_t *t, uint32_t lowMicros[], uint32_t highMicros[], uint8_t data[DHT_BYTES]) {
+	dht_decode_widths_t widths;
+	int known = dht_model_get(t->type, t->pin, &widths);
+	return dht_decode_learned(lowMicros, highMicros, t->gaps, t->gapCount, known ? &widths : NULL, data, NULL);
+}
+
+static const decoder_t decoders[] = {
+	{ "iterative", iterative, 0 },
+	{ "linear", linear, 0 },
+	{ "corrected", corrected, 0 },
+	{ "gaps", gaps, 0 },
+	{ "preamble", preamble, 0 },
+	{ "learned", learned, 1 },
+};
+
+static double nowNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void printCsv(uint64_t index, const dht_trace_t *t) {
+	printf("%llu,%d,%d,%d,%d,%lld,%02x%02x%02x%02x%02x", (unsigned long long)index, t->type, t->pin, t->clock,
+		t->flags, (long long)t->timestampNanos, t->data[0], t->data[1], t->data[2], t->data[3], t->data[4]);
+	int i;
+	for (i = 0; i < t->deltaCount; i++) {
+		printf(",%u", t->deltas[i]);
+	}
+	for (i = 0; i < t->gapCount; i++) {
+		printf(",g%d:%u", t->gaps[i].edge, t->gaps[i].lengthMicros);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	int repeat = 1;
+	int csv = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "cm:r:")) != -1) {
+		switch (opt) {
+		case 'c': csv = 1; break;
+		case 'm':
+			if (dht_model_load(optarg) != DHT_MODEL_SUCCESS) {
+				printf("Cannot read model file %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r': repeat = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+		default:
+			printf("usage: dht_replay [-r REPEAT] [-m MODEL_FILE] [-c] FILE...\n");
+			return 2;
+		}
+	}
+
+	// Load the complete traces of all files.
+	dht_trace_t *traces = NULL;
+	size_t count = 0, capacity = 0, incomplete = 0, unreadable = 0;
+	int f;
+	for (f = optind; f < argc; f++) {
+		dht_trace_file_t *file = dht_trace_open(argv[f]);
+		if (file == NULL) {
+			printf("Cannot read trace file %s\n", argv[f]);
+			return 1;
+		}
+		uint64_t index, end = dht_trace_end(file);
+		for (index = dht_trace_first(file); index < end; index++) {
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 4096;
+				traces = realloc(traces, capacity * sizeof(*traces));
+				if (traces == NULL) {
+					return 1;
+				}
+			}
+			if (dht_trace_get(file, index, &traces[count]) != DHT_TRACE_SUCCESS) {
+				unreadable++;
+			} else if (csv) {
+				printCsv(index, &traces[count]);
+			} else if (traces[count].deltaCount < DHT_TRACE_DELTAS) {
+				incomplete++;
+			} else {
+				count++;
+			}
+		}
+		dht_trace_close(file);
+	}
+	if (csv) {
+		return 0;
+	}
+	size_t recorded = 0;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		recorded += (traces[i].flags & DHT_TRACE_DECODED) != 0;
+	}
+	printf("%zu complete traces (%zu decoded when recorded), %zu incomplete, %zu unreadable\n",
+		count, recorded, incomplete, unreadable);
+	if (count == 0) {
+		return 0;
+	}
+
+	// Decoded: checksum passed.  Agree: same data as recorded.  Gained/lost:
+	// decoded now but not when recorded, and vice versa.  Differ: both
+	// decoded, to different data.
+	printf("%-10s %10s %9s %9s %9s %9s %9s\n", "decoder", "ns/decode", "decoded", "agree", "gained", "lost", "differ");
+	size_t d;
+	for (d = 0; d < sizeof(decoders) / sizeof(decoders[0]); d++) {
+		size_t decoded = 0, agree = 0, gained = 0, lost = 0, differ = 0;
+		double started = nowNanos();
+		int r;
+		for (r = 0; r < repeat; r++) {
+			for (i = 0; i < count; i++) {
+				uint32_t lowMicros[DHT_PULSES + 1];
+				uint32_t highMicros[DHT_PULSES];
+				uint8_t data[DHT_BYTES];
+				const dht_trace_t *t = &traces[i];
+				dht_trace_pulses(t, lowMicros, highMicros);
+				int ok = decoders[d].decode(t, lowMicros, highMicros, data);
+				if (r > 0) {
+					continue;
+				}
+				if (ok && decoders[d].learns) {
+					dht_model_learn(t->type, t->pin, lowMicros, highMicros, data);
+				}
+				int wasOk = (t->flags & DHT_TRACE_DECODED) != 0;
+				decoded += ok;
+				if (ok && wasOk) {
+					if (memcmp(data, t->data, DHT_BYTES) == 0) {
+						agree++;
+					} else {
+						differ++;
+					}
+				} else if (ok) {
+					gained++;
+				} else if (wasOk) {
+					lost++;
+				}
+			}
+		}
+		double nanos = (nowNanos() - started) / ((double)count * repeat);
+		printf("%-10s %10.1f %9zu %9zu %9zu %9zu %9zu\n", decoders[d].name, nanos, decoded, agree, gained, lost, differ);
+	}
+	free(traces);
+	return 0;
+}
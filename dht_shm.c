@@ -0,0 +1,88 @@
+// Shared memory readings.  See dht_shm.h.
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dht_shm.h"
+
+static dht_shm_t *map(const char *name, int flags, int prot) {
+	int fd = shm_open(name, flags, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+	if ((flags & O_CREAT) && ftruncate(fd, sizeof(dht_shm_t)) == -1) {
+		close(fd);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(dht_shm_t)) {
+		close(fd);
+		return NULL;
+	}
+	void *shm = mmap(NULL, sizeof(dht_shm_t), prot, MAP_SHARED, fd, 0);
+	close(fd);
+	return (shm == MAP_FAILED) ? NULL : shm;
+}
+
+dht_shm_t *dht_shm_create(const char *name, int sensors) {
+	if (sensors < 0 || sensors > DHT_SHM_SENSORS) {
+		return NULL;
+	}
+	dht_shm_t *shm = map(name, O_CREAT | O_RDWR, PROT_READ | PROT_WRITE);
+	if (shm == NULL) {
+		return NULL;
+	}
+	// Readers check the magic last, so hide the segment while resetting it.
+	__atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+	memset(shm->slots, 0, sizeof(shm->slots));
+	shm->version = DHT_SHM_VERSION;
+	shm->sensors = sensors;
+	shm->writerPid = getpid();
+	__atomic_store_n(&shm->magic, DHT_SHM_MAGIC, __ATOMIC_RELEASE);
+	return shm;
+}
+
+dht_shm_t *dht_shm_open(const char *name) {
+	dht_shm_t *shm = map(name, O_RDONLY, PROT_READ);
+	if (shm != NULL && (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != DHT_SHM_MAGIC ||
+			shm->version != DHT_SHM_VERSION)) {
+		dht_shm_close(shm);
+		return NULL;
+	}
+	return shm;
+}
+
+void dht_shm_close(dht_shm_t *shm) {
+	if (shm != NULL) {
+		munmap(shm, sizeof(dht_shm_t));
+	}
+}
+
+void dht_shm_write(dht_shm_t *shm, int index, const dht_shm_reading_t *reading) {
+	if (index < 0 || index >= DHT_SHM_SENSORS) {
+		return;
+	}
+	dht_shm_slot_t *slot = &shm->slots[index];
+	uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->reading, reading, sizeof(*reading));
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+int dht_shm_read(const dht_shm_t *shm, int index, dht_shm_reading_t *reading) {
+	if (index < 0 || index >= (int)shm->sensors || index >= DHT_SHM_SENSORS) {
+		return DHT_SHM_ERROR_INDEX;
+	}
+	const dht_shm_slot_t *slot = &shm->slots[index];
+	uint32_t before, after;
+	do {
+		before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		memcpy(reading, (const void *)&slot->reading, sizeof(*reading));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+	return (reading->readings > 0) ? DHT_SHM_SUCCESS : DHT_SHM_ERROR_NO_DATA;
+}
@@ -0,0 +1,77 @@
+// Latest readings of all sensors, published by dhtd in a POSIX shared memory
+// segment.  Every sensor slot is protected by a sequence lock: the writer
+// makes the sequence odd while it updates the slot, so readers never block
+// and simply copy the slot again if it changed under them.
+//
+//	dht_shm_t *shm = dht_shm_open();
+//	dht_shm_reading_t reading;
+//	if (shm != NULL && dht_shm_read(shm, 0, &reading) == DHT_SHM_SUCCESS) ...
+#ifndef DHT_SHM_H
+#define DHT_SHM_H
+
+#include <stdint.h>
+
+#define DHT_SHM_NAME "/dht_read"
+#define DHT_SHM_MAGIC 0x44485453	// "DHTS"
+#define DHT_SHM_VERSION 1
+
+// Sensors one segment can hold.
+#define DHT_SHM_SENSORS 32
+
+#define DHT_SHM_SUCCESS 0
+#define DHT_SHM_ERROR_INDEX -1
+#define DHT_SHM_ERROR_NO_DATA -2
+
+typedef struct {
+	int32_t type;
+	int32_t pin;
+	// Successful reads so far, which numbers the values below.
+	uint32_t readings;
+	// Failed reads since the last successful one.
+	uint32_t failures;
+	float humidity;
+	float temperature;
+	// CLOCK_REALTIME of the last successful read.
+	int64_t timestampSec;
+	int32_t timestampNsec;
+	// Configured read interval.
+	uint32_t intervalMillis;
+} dht_shm_reading_t;
+
+typedef struct {
+	// Odd while the reading is updated.
+	uint32_t sequence;
+	uint32_t reserved;
+	dht_shm_reading_t reading;
+} dht_shm_slot_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	// Slots in use.
+	uint32_t sensors;
+	// Process id of the daemon writing the segment.
+	int32_t writerPid;
+	dht_shm_slot_t slots[DHT_SHM_SENSORS];
+} dht_shm_t;
+
+// Create (or take over) the segment for writing, with (sensors) slots.
+// Returns NULL on failure.
+dht_shm_t *dht_shm_create(const char *name, int sensors);
+
+// Map an existing segment read only.  Returns NULL if it doesn't exist or
+// was written by an incompatible version.
+dht_shm_t *dht_shm_open(const char *name);
+
+// Unmap a segment returned by dht_shm_create() or dht_shm_open().
+void dht_shm_close(dht_shm_t *shm);
+
+// Publish (reading) in slot (index).  Only one writer per segment.
+void dht_shm_write(dht_shm_t *shm, int index, const dht_shm_reading_t *reading);
+
+// Copy a consistent snapshot of slot (index).  Returns DHT_SHM_SUCCESS, or
+// DHT_SHM_ERROR_NO_DATA (with the snapshot filled) before the first
+// successful read, or DHT_SHM_ERROR_INDEX.
+int dht_shm_read(const dht_shm_t *shm, int index, dht_shm_reading_t *reading);
+
+#endif
@@ -0,0 +1,248 @@
+// Simulated DHT11/DHT22 sensors.  See dht_sim.h.
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "dht_sim.h"
+#include "pi_dht_read.h"
+
+// Response of the sensor after the host releases the line, in nanoseconds.
+#define SIM_RESPONSE_NS      30000
+#define SIM_PREAMBLE_LOW_NS  80000
+#define SIM_PREAMBLE_HIGH_NS 80000
+#define SIM_BIT_LOW_NS       50000
+#define SIM_ZERO_HIGH_NS     27000
+#define SIM_ONE_HIGH_NS      70000
+
+// Falling and rising edge of the preamble, the falling edge starting bit 0,
+// two edges per bit and the final rising edge releasing the line.
+#define SIM_EDGES (2 + 1 + 40 * 2 + 1)
+
+typedef struct {
+	int type;
+	uint8_t data[5];
+	// Clock error in percent, stretching every width.
+	int clockSkew;
+	// Host side of the line.
+	bool output;
+	bool driveHigh;
+	uint64_t lowStartedNanos;
+	// Sensor side of the line.  The line is high until edges[0] and toggles at
+	// every following edge.
+	uint64_t edges[SIM_EDGES];
+	int edgeCount;
+	int cursor;
+} sim_pin_t;
+
+static sim_pin_t simPins[DHT_SIM_PINS];
+static uint64_t simNanos;
+static uint32_t simGpioReadNanos = 80;
+static uint32_t simTimerReadNanos = 120;
+static uint32_t simPreemptIntervalMicros;
+static uint32_t simPreemptMaxMicros;
+static uint64_t simNextPreemptNanos;
+static uint32_t simRngState = 2463534242u;
+
+void dht_sim_reset(void) {
+	memset(simPins, 0, sizeof(simPins));
+	simNanos = 0;
+	simNextPreemptNanos = (uint64_t)simPreemptIntervalMicros * 1000;
+}
+
+int dht_sim_attach(int pin, int type, float humidity, float temperature) {
+	if (pin < 0 || pin >= DHT_SIM_PINS || (type != DHT11 && type != DHT22)) {
+		return -1;
+	}
+	sim_pin_t *p = &simPins[pin];
+	memset(p, 0, sizeof(*p));
+	p->type = type;
+	p->driveHigh = true;
+	if (type == DHT11) {
+		p->data[0] = (uint8_t)lroundf(humidity);
+		p->data[2] = (uint8_t)lroundf(temperature);
+	} else {
+		long h = lroundf(humidity * 10.0f);
+		long t = lroundf(fabsf(temperature) * 10.0f);
+		p->data[0] = (uint8_t)(h >> 8);
+		p->data[1] = (uint8_t)h;
+		p->data[2] = (uint8_t)((t >> 8) & 0x7F) | (temperature < 0.0f ? 0x80 : 0);
+		p->data[3] = (uint8_t)t;
+	}
+	p->data[4] = (uint8_t)(p->data[0] + p->data[1] + p->data[2] + p->data[3]);
+	return 0;
+}
+
+int dht_sim_set_bytes(int pin, const uint8_t data[5]) {
+	if (pin < 0 || pin >= DHT_SIM_PINS || simPins[pin].type == 0) {
+		return -1;
+	}
+	memcpy(simPins[pin].data, data, sizeof(simPins[pin].data));
+	return 0;
+}
+
+int dht_sim_set_clock_skew(int pin, int percent) {
+	if (pin < 0 || pin >= DHT_SIM_PINS || simPins[pin].type == 0) {
+		return -1;
+	}
+	simPins[pin].clockSkew = percent;
+	return 0;
+}
+
+void dht_sim_set_read_costs(uint32_t gpioReadNanos, uint32_t timerReadNanos) {
+	simGpioReadNanos = gpioReadNanos;
+	simTimerReadNanos = timerReadNanos;
+}
+
+void dht_sim_set_preemption(uint32_t meanIntervalMicros, uint32_t maxStallMicros) {
+	simPreemptIntervalMicros = meanIntervalMicros;
+	simPreemptMaxMicros = maxStallMicros;
+	simNextPreemptNanos = simNanos + (uint64_t)meanIntervalMicros * 1000;
+}
+
+static uint32_t sim_rng(void) {
+	simRngState ^= simRngState << 13;
+	simRngState ^= simRngState >> 17;
+	simRngState ^= simRngState << 5;
+	return simRngState;
+}
+
+// Advance the clock by a read taking (nanos), preempted now and then.
+static void sim_read_cost(uint32_t nanos) {
+	simNanos += nanos;
+	if (simPreemptIntervalMicros == 0 || simPreemptMaxMicros == 0 || simNanos < simNextPreemptNanos) {
+		return;
+	}
+	simNanos += (uint64_t)(1 + sim_rng() % simPreemptMaxMicros) * 1000;
+	simNextPreemptNanos = simNanos + (uint64_t)(sim_rng() % (2 * simPreemptIntervalMicros + 1)) * 1000;
+}
+
+void dht_sim_set_nanos(uint64_t nanos) {
+	simNanos = nanos;
+}
+
+uint64_t dht_sim_nanos(void) {
+	return simNanos;
+}
+
+// Width (nanos) as timed by the clock of the sensor (p).
+static uint64_t sim_width(const sim_pin_t *p, uint64_t nanos) {
+	return nanos * (100 + p->clockSkew) / 100;
+}
+
+// Lay out the edges of one transmission starting at (releaseNanos).
+static void sim_trigger(sim_pin_t *p, uint64_t releaseNanos) {
+	uint64_t t = releaseNanos + sim_width(p, SIM_RESPONSE_NS);
+	int n = 0;
+	p->edges[n++] = t;
+	t += sim_width(p, SIM_PREAMBLE_LOW_NS);
+	p->edges[n++] = t;
+	t += sim_width(p, SIM_PREAMBLE_HIGH_NS);
+	p->edges[n++] = t;
+	int i;
+	for (i = 0; i < 40; i++) {
+		t += sim_width(p, SIM_BIT_LOW_NS);
+		p->edges[n++] = t;
+		bool one = (p->data[i / 8] >> (7 - i % 8)) & 1;
+		t += sim_width(p, one ? SIM_ONE_HIGH_NS : SIM_ZERO_HIGH_NS);
+		p->edges[n++] = t;
+	}
+	t += sim_width(p, SIM_BIT_LOW_NS);
+	p->edges[n++] = t;
+	p->edgeCount = n;
+	p->cursor = 0;
+}
+
+static int sim_init(void) {
+	return 0;
+}
+
+static void sim_set_input(int pin) {
+	sim_pin_t *p = &simPins[pin];
+	if (p->output && !p->driveHigh && p->type != 0) {
+		// DHT11 needs at least 18 ms start signal, DHT22 at least 1 ms.
+		uint64_t minStartNanos = (p->type == DHT11) ? 18000000 : 1000000;
+		if (simNanos - p->lowStartedNanos >= minStartNanos) {
+			sim_trigger(p, simNanos);
+		}
+	}
+	p->output = false;
+}
+
+static void sim_set_output(int pin) {
+	sim_pin_t *p = &simPins[pin];
+	if (!p->output && !p->driveHigh) {
+		p->lowStartedNanos = simNanos;
+	}
+	p->output = true;
+	p->edgeCount = 0;
+}
+
+static void sim_set_high(int pin) {
+	simPins[pin].driveHigh = true;
+}
+
+static void sim_set_low(int pin) {
+	sim_pin_t *p = &simPins[pin];
+	if (p->driveHigh) {
+		p->lowStartedNanos = simNanos;
+	}
+	p->driveHigh = false;
+}
+
+static bool sim_level(sim_pin_t *p) {
+	if (p->output) {
+		return p->driveHigh;
+	}
+	while (p->cursor < p->edgeCount && p->edges[p->cursor] <= simNanos) {
+		p->cursor++;
+	}
+	// Pulled up while idle, low after every odd number of edges.
+	return (p->cursor & 1) == 0;
+}
+
+static uint32_t sim_input(int pin) {
+	sim_read_cost(simGpioReadNanos);
+	return sim_level(&simPins[pin]) ? (1u << pin) : 0;
+}
+
+static uint32_t sim_input_all(void) {
+	sim_read_cost(simGpioReadNanos);
+	uint32_t levels = 0;
+	int pin;
+	for (pin = 0; pin < DHT_SIM_PINS; pin++) {
+		if (sim_level(&simPins[pin])) {
+			levels |= 1u << pin;
+		}
+	}
+	return levels;
+}
+
+static uint32_t sim_timer_micros(void) {
+	sim_read_cost(simTimerReadNanos);
+	return (uint32_t)(simNanos / 1000);
+}
+
+static uint64_t sim_timer_micros64(void) {
+	sim_read_cost(simTimerReadNanos);
+	return simNanos / 1000;
+}
+
+static void sim_sleep_millis(uint32_t millis) {
+	simNanos += (uint64_t)millis * 1000000;
+}
+
+const dht_backend_t dht_sim_backend = {
+	.name = "simulator",
+	.in_process = 1,
+	.init = sim_init,
+	.set_input = sim_set_input,
+	.set_output = sim_set_output,
+	.set_high = sim_set_high,
+	.set_low = sim_set_low,
+	.input = sim_input,
+	.input_all = sim_input_all,
+	.timer_micros = sim_timer_micros,
+	.timer_micros64 = sim_timer_micros64,
+	.sleep_millis = sim_sleep_millis,
+	.busy_wait_millis = sim_sleep_millis,
+};
@@ -0,0 +1,48 @@
+// Simulated DHT11/DHT22 sensors for running dht_read() without hardware.
+//
+// The simulator keeps a virtual nanosecond clock which only advances when the
+// capture code reads a pin, reads the timer or sleeps, so a complete read runs
+// in a few microseconds of real time and is fully deterministic.  A sensor
+// answers when the host releases the line after holding it low long enough,
+// and then plays the DHT waveform for the bytes set with dht_sim_attach() or
+// dht_sim_set_bytes().
+#ifndef DHT_SIM_H
+#define DHT_SIM_H
+
+#include <stdint.h>
+
+#include "dht_backend.h"
+
+// Highest pin number + 1 the simulator can host a sensor on.
+#define DHT_SIM_PINS 32
+
+extern const dht_backend_t dht_sim_backend;
+
+// Detach all sensors and restart the virtual clock at zero.
+void dht_sim_reset(void);
+
+// Attach a sensor of (type) to (pin) which reports the given values.
+// Returns 0 on success, -1 if pin or type is invalid.
+int dht_sim_attach(int pin, int type, float humidity, float temperature);
+
+// Override the five bytes (including checksum) sent by the sensor on (pin).
+// Returns 0 on success, -1 if no sensor is attached.
+int dht_sim_set_bytes(int pin, const uint8_t data[5]);
+
+// Run the sensor on (pin) with a clock (percent) slower (or faster if
+// negative) than nominal, stretching every pulse it sends.
+// Returns 0 on success, -1 if no sensor is attached.
+int dht_sim_set_clock_skew(int pin, int percent);
+
+// Set how much virtual time one pin read and one timer read take.
+void dht_sim_set_read_costs(uint32_t gpioReadNanos, uint32_t timerReadNanos);
+
+// Preempt the reader on average every (meanIntervalMicros) of pin and timer
+// reads, for a random 1 to (maxStallMicros) microseconds.  0 disables.
+void dht_sim_set_preemption(uint32_t meanIntervalMicros, uint32_t maxStallMicros);
+
+// Set and get the virtual clock.
+void dht_sim_set_nanos(uint64_t nanos);
+uint64_t dht_sim_nanos(void);
+
+#endif
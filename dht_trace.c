@@ -0,0 +1,282 @@
+// Recording of raw captures.  See dht_trace.h.
+#define _FILE_OFFSET_BITS 64
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dht_trace.h"
+
+struct dht_trace_file {
+	dht_trace_header_t *header;
+	uint8_t *slots;
+	size_t size;
+};
+
+// Offsets in a slot.
+#define SLOT_SEQUENCE 0
+#define SLOT_TYPE 4
+#define SLOT_PIN 5
+#define SLOT_CLOCK 6
+#define SLOT_FLAGS 7
+#define SLOT_TIMESTAMP 8
+#define SLOT_DATA 16
+#define SLOT_DELTA_COUNT 21
+#define SLOT_LENGTH 22
+#define SLOT_DELTAS 24
+
+// Oldest version which can still be read.
+#define MIN_READ_VERSION 1
+
+static dht_trace_file_t recording;
+static int recordFlags;
+
+void dht_trace_pulses(const dht_trace_t *trace, uint32_t lowMicros[DHT_PULSES + 1], uint32_t highMicros[DHT_PULSES]) {
+	int i;
+	for (i = 0; i <= DHT_PULSES; i++) {
+		lowMicros[i] = trace->deltas[2 * i];
+		if (i < DHT_PULSES) {
+			highMicros[i] = trace->deltas[2 * i + 1];
+		}
+	}
+}
+
+// Append (value), saturated at DHT_TRACE_MAX_DELTA, at (p) as a varint.
+static uint8_t *putVarint(uint8_t *p, uint32_t value) {
+	if (value > DHT_TRACE_MAX_DELTA) {
+		value = DHT_TRACE_MAX_DELTA;
+	}
+	while (value >= 0x80) {
+		*p++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+// Read a varint at *pp, before (end), into *pValue.  Returns 0 if malformed.
+static int getVarint(const uint8_t **pp, const uint8_t *end, uint32_t *pValue) {
+	const uint8_t *p = *pp;
+	uint32_t value = 0;
+	int shift = 0;
+	do {
+		if (p == end || shift > 14) {
+			return 0;
+		}
+		value |= (uint32_t)(*p & 0x7F) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*pp = p;
+	*pValue = value;
+	return 1;
+}
+
+void dht_trace_encode(const dht_trace_t *trace, uint32_t sequence, uint8_t slot[DHT_TRACE_SLOT_SIZE]) {
+	int count = (trace->deltaCount < 0) ? 0 : (trace->deltaCount > DHT_TRACE_DELTAS) ? DHT_TRACE_DELTAS : trace->deltaCount;
+	int gapCount = (trace->gapCount > DHT_MAX_GAPS) ? DHT_MAX_GAPS : trace->gapCount;
+	memcpy(slot + SLOT_SEQUENCE, &sequence, sizeof(sequence));
+	slot[SLOT_TYPE] = (uint8_t)trace->type;
+	slot[SLOT_PIN] = (uint8_t)trace->pin;
+	slot[SLOT_CLOCK] = (uint8_t)trace->clock;
+	slot[SLOT_FLAGS] = (uint8_t)((trace->flags & ~DHT_TRACE_GAPS) | (gapCount >= 0 ? DHT_TRACE_GAPS : 0));
+	memcpy(slot + SLOT_TIMESTAMP, &trace->timestampNanos, sizeof(trace->timestampNanos));
+	memcpy(slot + SLOT_DATA, trace->data, DHT_BYTES);
+	slot[SLOT_DELTA_COUNT] = (uint8_t)count;
+	uint8_t *p = slot + SLOT_DELTAS;
+	int i;
+	for (i = 0; i < count; i++) {
+		p = putVarint(p, trace->deltas[i]);
+	}
+	uint16_t length = (uint16_t)(p - (slot + SLOT_DELTAS));
+	memcpy(slot + SLOT_LENGTH, &length, sizeof(length));
+	// At most 2 bytes per delta and 3 per gap: always fits.
+	if (gapCount >= 0) {
+		*p++ = (uint8_t)gapCount;
+		for (i = 0; i < gapCount; i++) {
+			*p++ = (uint8_t)trace->gaps[i].edge;
+			p = putVarint(p, trace->gaps[i].lengthMicros);
+		}
+	}
+}
+
+int dht_trace_decode(const uint8_t slot[DHT_TRACE_SLOT_SIZE], dht_trace_t *trace) {
+	uint16_t length;
+	memcpy(&length, slot + SLOT_LENGTH, sizeof(length));
+	trace->deltaCount = slot[SLOT_DELTA_COUNT];
+	if (trace->deltaCount > DHT_TRACE_DELTAS || length > DHT_TRACE_SLOT_SIZE - SLOT_DELTAS) {
+		return DHT_TRACE_ERROR_FORMAT;
+	}
+	trace->type = slot[SLOT_TYPE];
+	trace->pin = slot[SLOT_PIN];
+	trace->clock = slot[SLOT_CLOCK];
+	trace->flags = slot[SLOT_FLAGS];
+	memcpy(&trace->timestampNanos, slot + SLOT_TIMESTAMP, sizeof(trace->timestampNanos));
+	memcpy(trace->data, slot + SLOT_DATA, DHT_BYTES);
+	const uint8_t *p = slot + SLOT_DELTAS;
+	const uint8_t *end = p + length;
+	int i;
+	for (i = 0; i < trace->deltaCount; i++) {
+		if (!getVarint(&p, end, &trace->deltas[i])) {
+			return DHT_TRACE_ERROR_FORMAT;
+		}
+	}
+	trace->gapCount = -1;
+	if (trace->flags & DHT_TRACE_GAPS) {
+		end = slot + DHT_TRACE_SLOT_SIZE;
+		if (p == end) {
+			return DHT_TRACE_ERROR_FORMAT;
+		}
+		trace->gapCount = *p++;
+		if (trace->gapCount > DHT_MAX_GAPS) {
+			return DHT_TRACE_ERROR_FORMAT;
+		}
+		for (i = 0; i < trace->gapCount; i++) {
+			if (p == end) {
+				return DHT_TRACE_ERROR_FORMAT;
+			}
+			trace->gaps[i].edge = *p++;
+			trace->gaps[i].startMicros = 0;
+			if (!getVarint(&p, end, &trace->gaps[i].lengthMicros)) {
+				return DHT_TRACE_ERROR_FORMAT;
+			}
+		}
+	}
+	return DHT_TRACE_SUCCESS;
+}
+
+// Files are only recorded into in the current version.
+static int validHeader(const dht_trace_header_t *header, size_t size, int writable) {
+	return memcmp(header->magic, DHT_TRACE_MAGIC, sizeof(header->magic)) == 0 &&
+		header->version <= DHT_TRACE_VERSION &&
+		header->version >= (writable ? DHT_TRACE_VERSION : MIN_READ_VERSION) &&
+		header->slotSize == DHT_TRACE_SLOT_SIZE &&
+		header->slotCount > 0 &&
+		size >= DHT_TRACE_HEADER_SIZE + (size_t)header->slotCount * DHT_TRACE_SLOT_SIZE;
+}
+
+static int mapFile(dht_trace_file_t *file, int fd, int prot) {
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < DHT_TRACE_HEADER_SIZE) {
+		return DHT_TRACE_ERROR_FORMAT;
+	}
+	void *map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		return DHT_TRACE_ERROR_OPEN;
+	}
+	file->header = map;
+	file->slots = (uint8_t *)map + DHT_TRACE_HEADER_SIZE;
+	file->size = st.st_size;
+	if (!validHeader(file->header, file->size, (prot & PROT_WRITE) != 0)) {
+		munmap(map, file->size);
+		file->header = NULL;
+		return DHT_TRACE_ERROR_FORMAT;
+	}
+	return DHT_TRACE_SUCCESS;
+}
+
+int dht_trace_start(const char *path, uint32_t slotCount, int flags) {
+	dht_trace_stop();
+	if (slotCount == 0) {
+		return DHT_TRACE_ERROR_FORMAT;
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return DHT_TRACE_ERROR_OPEN;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0) {
+		// New file: write the header before mapping it.
+		dht_trace_header_t header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, DHT_TRACE_MAGIC, sizeof(header.magic));
+		header.version = DHT_TRACE_VERSION;
+		header.slotSize = DHT_TRACE_SLOT_SIZE;
+		header.slotCount = slotCount;
+		if (ftruncate(fd, DHT_TRACE_HEADER_SIZE + (off_t)slotCount * DHT_TRACE_SLOT_SIZE) == -1 ||
+				pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+			close(fd);
+			return DHT_TRACE_ERROR_OPEN;
+		}
+	}
+	int result = mapFile(&recording, fd, PROT_READ | PROT_WRITE);
+	close(fd);
+	recordFlags = flags;
+	return result;
+}
+
+void dht_trace_stop(void) {
+	if (recording.header != NULL) {
+		munmap(recording.header, recording.size);
+		recording.header = NULL;
+	}
+}
+
+int dht_trace_recording(void) {
+	return recording.header != NULL;
+}
+
+void dht_trace_record(const dht_trace_t *trace) {
+	dht_trace_header_t *header = recording.header;
+	if (header == NULL || ((recordFlags & DHT_TRACE_FAILURES_ONLY) && (trace->flags & DHT_TRACE_DECODED))) {
+		return;
+	}
+	uint64_t index = __atomic_fetch_add(&header->written, 1, __ATOMIC_RELAXED);
+	uint8_t *slot = recording.slots + (index % header->slotCount) * DHT_TRACE_SLOT_SIZE;
+	// Invalidate the slot while writing, and publish the sequence last.
+	__atomic_store_n((uint32_t *)slot, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	uint8_t encoded[DHT_TRACE_SLOT_SIZE];
+	dht_trace_encode(trace, 0, encoded);
+	memcpy(slot + sizeof(uint32_t), encoded + sizeof(uint32_t), DHT_TRACE_SLOT_SIZE - sizeof(uint32_t));
+	__atomic_store_n((uint32_t *)slot, (uint32_t)(index + 1), __ATOMIC_RELEASE);
+}
+
+dht_trace_file_t *dht_trace_open(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	dht_trace_file_t *file = malloc(sizeof(*file));
+	if (file != NULL && mapFile(file, fd, PROT_READ) != DHT_TRACE_SUCCESS) {
+		free(file);
+		file = NULL;
+	}
+	close(fd);
+	return file;
+}
+
+void dht_trace_close(dht_trace_file_t *file) {
+	if (file != NULL) {
+		munmap(file->header, file->size);
+		free(file);
+	}
+}
+
+uint64_t dht_trace_end(const dht_trace_file_t *file) {
+	return __atomic_load_n(&file->header->written, __ATOMIC_ACQUIRE);
+}
+
+uint64_t dht_trace_first(const dht_trace_file_t *file) {
+	uint64_t end = dht_trace_end(file);
+	return (end > file->header->slotCount) ? end - file->header->slotCount : 0;
+}
+
+int dht_trace_get(const dht_trace_file_t *file, uint64_t index, dht_trace_t *trace) {
+	if (index < dht_trace_first(file) || index >= dht_trace_end(file)) {
+		return DHT_TRACE_ERROR_INDEX;
+	}
+	const uint8_t *slot = file->slots + (index % file->header->slotCount) * DHT_TRACE_SLOT_SIZE;
+	uint8_t copy[DHT_TRACE_SLOT_SIZE];
+	uint32_t before = __atomic_load_n((const uint32_t *)slot, __ATOMIC_ACQUIRE);
+	memcpy(copy, slot, DHT_TRACE_SLOT_SIZE);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint32_t after = __atomic_load_n((const uint32_t *)slot, __ATOMIC_RELAXED);
+	if (before != (uint32_t)(index + 1) || after != before) {
+		// Still holding (or reset for) an older trace while being written,
+		// or already overwritten by a newer one.
+		return ((int32_t)(before - (uint32_t)(index + 1)) < 0) ? DHT_TRACE_ERROR_INCOMPLETE : DHT_TRACE_ERROR_INDEX;
+	}
+	return dht_trace_decode(copy, trace);
+}
@@ -0,0 +1,134 @@
+// Recording of raw captures for offline analysis.
+//
+// Every capture is stored as a trace: sensor type, pin, clock source, wall
+// clock time and outcome, then the time between consecutive edges of the
+// response (lowMicros[0], highMicros[0], lowMicros[1], ... lowMicros[41])
+// as LEB128 varints, and the preemption gaps the capture recorded (see
+// dht_gap_t).  Traces go into fixed size slots of a memory mapped
+// ring file, so recording costs no system call and the file never grows;
+// several processes may record into the same file.
+//
+// File layout (native byte order):
+//	header	DHT_TRACE_HEADER_SIZE bytes, see dht_trace_header_t
+//	slots	slotCount * DHT_TRACE_SLOT_SIZE bytes, trace n in slot n % slotCount
+// Slot layout:
+//	0	uint32	sequence: n + 1 once trace n is complete
+//	4	uint8	sensor type (11, 22)
+//	5	uint8	pin
+//	6	uint8	clock (dht_trace_clock_t)
+//	7	uint8	flags (DHT_TRACE_*)
+//	8	int64	CLOCK_REALTIME nanoseconds of the release of the line
+//	16	uint8[5] decoded bytes
+//	21	uint8	number of edge deltas
+//	22	uint16	bytes of encoded deltas
+//	24	varint deltas in microseconds, saturated at DHT_TRACE_MAX_DELTA
+// followed, with DHT_TRACE_GAPS (version 2), by:
+//	uint8	number of gaps
+//	gaps	uint8 edge, then varint length in microseconds, saturated at
+//		DHT_TRACE_MAX_DELTA; their start isn't recorded
+// Version 1 files, without gaps, can still be read.
+#ifndef DHT_TRACE_H
+#define DHT_TRACE_H
+
+#include <stdint.h>
+
+#include "pi_dht_read.h"
+
+#define DHT_TRACE_SUCCESS 0
+#define DHT_TRACE_ERROR_OPEN -1
+#define DHT_TRACE_ERROR_FORMAT -2
+#define DHT_TRACE_ERROR_INDEX -3
+#define DHT_TRACE_ERROR_INCOMPLETE -4
+
+#define DHT_TRACE_MAGIC "DHTTRACE"
+#define DHT_TRACE_VERSION 2
+#define DHT_TRACE_HEADER_SIZE 64
+#define DHT_TRACE_SLOT_SIZE 256
+
+// Deltas of a complete response: all pulses and the final low.
+#define DHT_TRACE_DELTAS (2 * DHT_PULSES + 1)
+// Longest delta stored, which keeps every delta within 2 varint bytes.
+#define DHT_TRACE_MAX_DELTA 16383
+
+// Trace flags.
+#define DHT_TRACE_DECODED 0x01		// Data passed the checksum (possibly after correction).
+#define DHT_TRACE_CORRECTED 0x02	// Bits were flipped to pass the checksum.
+#define DHT_TRACE_GAPS 0x04		// The gaps follow the deltas (set from gapCount).
+#define DHT_TRACE_FAILURES_ONLY 0x80	// dht_trace_start(): skip successful reads.
+
+typedef enum {
+	// Same order as pi_timer_source_t.
+	DHT_TRACE_CLOCK_SYSTEM_TIMER,
+	DHT_TRACE_CLOCK_MONOTONIC_RAW,
+	DHT_TRACE_CLOCK_MONOTONIC,
+	// Edge timestamps of the backend's own capture (gpiochip events).
+	DHT_TRACE_CLOCK_EVENTS,
+	// Any other backend, such as the simulator.
+	DHT_TRACE_CLOCK_OTHER,
+} dht_trace_clock_t;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t slotSize;
+	uint32_t slotCount;
+	uint32_t reserved;
+	// Traces written so far.
+	uint64_t written;
+	uint8_t padding[DHT_TRACE_HEADER_SIZE - 32];
+} dht_trace_header_t;
+
+typedef struct {
+	int type;
+	int pin;
+	int clock;
+	int flags;
+	int64_t timestampNanos;
+	uint8_t data[DHT_BYTES];
+	// Deltas recorded; fewer than DHT_TRACE_DELTAS if the capture timed out.
+	int deltaCount;
+	uint32_t deltas[DHT_TRACE_DELTAS];
+	// Gaps recorded by the capture, -1 if not known.  startMicros is 0.
+	int gapCount;
+	dht_gap_t gaps[DHT_MAX_GAPS];
+} dht_trace_t;
+
+// Split the deltas of a complete trace into the arrays taken by the decoders.
+void dht_trace_pulses(const dht_trace_t *trace, uint32_t lowMicros[DHT_PULSES + 1], uint32_t highMicros[DHT_PULSES]);
+
+// Encode (trace) into a slot, and decode a slot.  dht_trace_decode()
+// returns DHT_TRACE_SUCCESS or DHT_TRACE_ERROR_FORMAT.
+void dht_trace_encode(const dht_trace_t *trace, uint32_t sequence, uint8_t slot[DHT_TRACE_SLOT_SIZE]);
+int dht_trace_decode(const uint8_t slot[DHT_TRACE_SLOT_SIZE], dht_trace_t *trace);
+
+// Record the captures of dht_read() and friends into the ring file (path),
+// created with (slotCount) slots if it doesn't exist.  (flags) may be
+// DHT_TRACE_FAILURES_ONLY.  Returns DHT_TRACE_SUCCESS or an error, such as
+// DHT_TRACE_ERROR_FORMAT for a file of an older version.
+int dht_trace_start(const char *path, uint32_t slotCount, int flags);
+void dht_trace_stop(void);
+
+// Append (trace) to the file being recorded, unless filtered out by the
+// flags of dht_trace_start().  Does nothing if not recording.
+void dht_trace_record(const dht_trace_t *trace);
+
+// Returns 1 while recording.
+int dht_trace_recording(void);
+
+// Read access to a ring file.
+typedef struct dht_trace_file dht_trace_file_t;
+
+// Map the ring file (path) read only.  Returns NULL on failure.
+dht_trace_file_t *dht_trace_open(const char *path);
+void dht_trace_close(dht_trace_file_t *file);
+
+// Index of the oldest trace still in the file, and one past the newest.
+uint64_t dht_trace_first(const dht_trace_file_t *file);
+uint64_t dht_trace_end(const dht_trace_file_t *file);
+
+// Get trace (index).  Returns DHT_TRACE_SUCCESS, DHT_TRACE_ERROR_INDEX if
+// it is not (or no longer) in the file, DHT_TRACE_ERROR_INCOMPLETE while
+// it is being written, or DHT_TRACE_ERROR_FORMAT.
+int dht_trace_get(const dht_trace_file_t *file, uint64_t index, dht_trace_t *trace);
+
+#endif
@@ -0,0 +1,227 @@
+// Daemon reading all sensors at their intervals and publishing the latest
+// values in shared memory (see dht_shm.h), so readers neither contend for
+// the sensors nor wait for a read.
+//
+//	dhtd [-s] [-n NAME] [-m MODEL_FILE] [-t SECONDS] TYPE:PIN[:INTERVAL] ...
+//	dhtd -p [-n NAME]
+//
+// -s reads simulated sensors, -m keeps the learned timing of the sensors
+// in MODEL_FILE between runs (see dht_model.h), -t exits after SECONDS, and
+// -p prints the readings currently published.  INTERVAL is in seconds
+// (default 2).
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pi_dht_read.h"
+#include "dht_backend.h"
+#include "dht_model.h"
+#include "dht_shm.h"
+#include "dht_sim.h"
+
+#define DEFAULT_INTERVAL_MS 2000
+
+// Wait before reading a sensor again after a failed read.
+#define RETRY_INTERVAL_MS 2000
+
+// Pins whose slot and learned timing the library tracks, 0-31.
+#define MAX_PINS 32
+
+typedef struct {
+	int type;
+	int pin;
+	uint32_t intervalMillis;
+	struct timespec due;
+	dht_shm_reading_t reading;
+} sensor_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int signum) {
+	(void)signum;
+	stopping = 1;
+}
+
+static void addMillis(struct timespec *ts, uint32_t millis) {
+	ts->tv_sec += millis / 1000;
+	ts->tv_nsec += (long)(millis % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int before(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Parse TYPE:PIN[:INTERVAL].
+static int parseSensor(const char *arg, sensor_t *sensor) {
+	double seconds = DEFAULT_INTERVAL_MS / 1000.0;
+	int type, pin;
+	if (sscanf(arg, "%d:%d:%lf", &type, &pin, &seconds) < 2 ||
+			(type != DHT11 && type != DHT22) || pin < 0 || pin >= MAX_PINS || seconds <= 0) {
+		return -1;
+	}
+	memset(sensor, 0, sizeof(*sensor));
+	sensor->type = type;
+	sensor->pin = pin;
+	sensor->intervalMillis = (uint32_t)(seconds * 1000 + 0.5);
+	sensor->reading.type = type;
+	sensor->reading.pin = pin;
+	sensor->reading.intervalMillis = sensor->intervalMillis;
+	return 0;
+}
+
+static int printReadings(const char *name) {
+	dht_shm_t *shm = dht_shm_open(name);
+	if (shm == NULL) {
+		printf("No readings published in %s\n", name);
+		return 1;
+	}
+	int i;
+	for (i = 0; i < (int)shm->sensors; i++) {
+		dht_shm_reading_t reading;
+		if (dht_shm_read(shm, i, &reading) == DHT_SHM_SUCCESS) {
+			printf("DHT%d pin %d #%u: temperature:%.1f Humidity:%.1f at %lld.%03d (%u failures)\n",
+				reading.type, reading.pin, reading.readings, reading.temperature, reading.humidity,
+				(long long)reading.timestampSec, reading.timestampNsec / 1000000, reading.failures);
+		} else {
+			printf("DHT%d pin %d: no reading yet (%u failures)\n", reading.type, reading.pin, reading.failures);
+		}
+	}
+	dht_shm_close(shm);
+	return 0;
+}
+
+static void usage(void) {
+	printf("usage: dhtd [-s] [-n NAME] [-m MODEL_FILE] [-t SECONDS] TYPE:PIN[:INTERVAL] ...\n"
+		"       dhtd -p [-n NAME]\n");
+}
+
+int main(int argc, char **argv) {
+	const char *name = DHT_SHM_NAME;
+	const char *modelPath = NULL;
+	int simulate = 0;
+	int print = 0;
+	double runSeconds = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:n:pst:")) != -1) {
+		switch (opt) {
+		case 'm': modelPath = optarg; break;
+		case 'n': name = optarg; break;
+		case 'p': print = 1; break;
+		case 's': simulate = 1; break;
+		case 't': runSeconds = atof(optarg); break;
+		default: usage(); return 2;
+		}
+	}
+	if (print) {
+		return printReadings(name);
+	}
+	int count = argc - optind;
+	if (count < 1 || count > DHT_SHM_SENSORS) {
+		usage();
+		return 2;
+	}
+	sensor_t sensors[DHT_SHM_SENSORS];
+	// One sensor per pin: two would share its slot.
+	uint32_t pinMask = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		if (parseSensor(argv[optind + i], &sensors[i]) < 0) {
+			printf("Bad sensor %s\n", argv[optind + i]);
+			usage();
+			return 2;
+		}
+		if (pinMask & (1u << sensors[i].pin)) {
+			printf("Pin %d given twice\n", sensors[i].pin);
+			usage();
+			return 2;
+		}
+		pinMask |= 1u << sensors[i].pin;
+	}
+	if (simulate) {
+		dht_sim_reset();
+		for (i = 0; i < count; i++) {
+			dht_sim_attach(sensors[i].pin, sensors[i].type, 45.6f, sensors[i].type == DHT11 ? 23.0f : -12.3f);
+		}
+		dht_set_backend(&dht_sim_backend);
+		dht_set_min_interval_millis(DHT11, 0);
+		dht_set_min_interval_millis(DHT22, 0);
+	}
+
+	if (modelPath != NULL && dht_model_open(modelPath) != DHT_MODEL_SUCCESS) {
+		printf("Cannot keep the timing model in %s\n", modelPath);
+		return 1;
+	}
+
+	dht_shm_t *shm = dht_shm_create(name, count);
+	if (shm == NULL) {
+		perror("Failed to create shared memory");
+		return 1;
+	}
+	// Keep the segment and the capture code resident.
+	mlockall(MCL_CURRENT | MCL_FUTURE);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	// The daemon schedules its own retries, so a bad sensor doesn't hold up
+	// the others.
+	dht_set_retries(0);
+	struct timespec now, end;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	end = now;
+	addMillis(&end, (uint32_t)(runSeconds * 1000));
+	for (i = 0; i < count; i++) {
+		sensors[i].due = now;
+		dht_shm_write(shm, i, &sensors[i].reading);
+	}
+
+	while (!stopping) {
+		sensor_t *next = &sensors[0];
+		for (i = 1; i < count; i++) {
+			if (before(&sensors[i].due, &next->due)) {
+				next = &sensors[i];
+			}
+		}
+		if (runSeconds > 0 && before(&end, &next->due)) {
+			break;
+		}
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next->due, NULL) != 0) {
+			continue;	// Interrupted, possibly to stop.
+		}
+		dht_result_t result;
+		dht_shm_reading_t *reading = &next->reading;
+		if (dht_read_ex(next->type, next->pin, &result)) {
+			reading->readings++;
+			reading->failures = 0;
+			reading->humidity = result.humidity;
+			reading->temperature = result.temperature;
+			reading->timestampSec = result.timestamp.tv_sec;
+			reading->timestampNsec = (int32_t)result.timestamp.tv_nsec;
+			addMillis(&next->due, next->intervalMillis);
+		} else {
+			reading->failures++;
+			addMillis(&next->due, RETRY_INTERVAL_MS < next->intervalMillis ? RETRY_INTERVAL_MS : next->intervalMillis);
+		}
+		dht_shm_write(shm, next - sensors, reading);
+		// Don't try to catch up after a stall: reads can't be closer than the interval.
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (before(&next->due, &now)) {
+			next->due = now;
+		}
+	}
+	dht_shm_close(shm);
+	shm_unlink(name);
+	dht_model_close();
+	return 0;
+}
@@ -0,0 +1,259 @@
+// GPIO character device backend.  See gpiochip.h.
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gpiochip.h"
+#include "pi_dht_read.h"
+#include "realtime.h"
+
+// Lines usable as DHT pins.  input() reports levels as (1 << pin).
+#define GPIOCHIP_LINES 32
+
+// Time allowed for a whole response.  The sensor answers within ~200 us
+// and sends 41 pulses of at most ~160 us each.
+#define CAPTURE_TIMEOUT_MS 20
+
+// Once only the releasing edge may be missing, wait this long for it.
+#define RELEASE_TIMEOUT_MS 2
+
+static const char *devicePath = "/dev/gpiochip0";
+static int chipFd = -1;
+static int lineFds[GPIOCHIP_LINES];
+static bool lineHigh[GPIOCHIP_LINES];
+
+void dht_gpiochip_set_device(const char *path) {
+	devicePath = (path != NULL) ? path : "/dev/gpiochip0";
+}
+
+static int gpiochip_init(void) {
+	if (chipFd < 0) {
+		chipFd = open(devicePath, O_RDWR | O_CLOEXEC);
+		if (chipFd < 0) {
+			return GPIOCHIP_ERROR_OPEN;
+		}
+		int i;
+		for (i = 0; i < GPIOCHIP_LINES; i++) {
+			lineFds[i] = -1;
+			lineHigh[i] = true;
+		}
+	}
+	return GPIOCHIP_SUCCESS;
+}
+
+static void fillConfig(struct gpio_v2_line_config *config, uint64_t flags, bool high) {
+	memset(config, 0, sizeof(*config));
+	config->flags = flags;
+	if (flags & GPIO_V2_LINE_FLAG_OUTPUT) {
+		config->num_attrs = 1;
+		config->attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		config->attrs[0].attr.values = high ? 1 : 0;
+		config->attrs[0].mask = 1;
+	}
+}
+
+// Request (pin) with (flags), or reconfigure the line if it is already held.
+static int configureLine(int pin, uint64_t flags) {
+	if (pin < 0 || pin >= GPIOCHIP_LINES || chipFd < 0) {
+		return GPIOCHIP_ERROR_REQUEST;
+	}
+	if (lineFds[pin] >= 0) {
+		struct gpio_v2_line_config config;
+		fillConfig(&config, flags, lineHigh[pin]);
+		if (ioctl(lineFds[pin], GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) == -1) {
+			return GPIOCHIP_ERROR_REQUEST;
+		}
+		return GPIOCHIP_SUCCESS;
+	}
+	struct gpio_v2_line_request request;
+	memset(&request, 0, sizeof(request));
+	request.offsets[0] = pin;
+	strncpy(request.consumer, "dht_read", sizeof(request.consumer) - 1);
+	fillConfig(&request.config, flags, lineHigh[pin]);
+	request.num_lines = 1;
+	request.event_buffer_size = 2 * DHT_EDGES;
+	if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request) == -1) {
+		return GPIOCHIP_ERROR_REQUEST;
+	}
+	// Non blocking so stale events can be drained; reads are gated by poll().
+	fcntl(request.fd, F_SETFL, fcntl(request.fd, F_GETFL) | O_NONBLOCK);
+	lineFds[pin] = request.fd;
+	return GPIOCHIP_SUCCESS;
+}
+
+// Discard events left over from an incomplete capture.
+static void drainEvents(int fd) {
+	struct gpio_v2_line_event events[16];
+	while (read(fd, events, sizeof(events)) > 0) {
+	}
+}
+
+static void gpiochip_set_input(int pin) {
+	configureLine(pin, GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING);
+}
+
+static void gpiochip_set_output(int pin) {
+	if (configureLine(pin, GPIO_V2_LINE_FLAG_OUTPUT) == GPIOCHIP_SUCCESS) {
+		drainEvents(lineFds[pin]);
+	}
+}
+
+static void setValue(int pin, bool high) {
+	if (pin < 0 || pin >= GPIOCHIP_LINES) {
+		return;
+	}
+	lineHigh[pin] = high;
+	if (lineFds[pin] >= 0) {
+		struct gpio_v2_line_values values = { .bits = high ? 1 : 0, .mask = 1 };
+		ioctl(lineFds[pin], GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+	}
+}
+
+static void gpiochip_set_high(int pin) {
+	setValue(pin, true);
+}
+
+static void gpiochip_set_low(int pin) {
+	setValue(pin, false);
+}
+
+static uint32_t gpiochip_input(int pin) {
+	if (pin < 0 || pin >= GPIOCHIP_LINES || lineFds[pin] < 0) {
+		return 0;
+	}
+	struct gpio_v2_line_values values = { .bits = 0, .mask = 1 };
+	if (ioctl(lineFds[pin], GPIO_V2_LINE_GET_VALUES_IOCTL, &values) == -1) {
+		return 0;
+	}
+	return (values.bits & 1) ? (1u << pin) : 0;
+}
+
+static uint64_t monotonicNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Event timestamps are CLOCK_MONOTONIC, so use the same clock.
+static uint32_t gpiochip_timer_micros(void) {
+	return (uint32_t)(monotonicNanos() / 1000);
+}
+
+static uint64_t gpiochip_timer_micros64(void) {
+	return monotonicNanos() / 1000;
+}
+
+static uint32_t nanosToMicros(uint64_t nanos) {
+	return (uint32_t)((nanos + 500) / 1000);
+}
+
+int dht_gpiochip_read_edges(int fd, int timeoutMillis, uint32_t lowMicros[], uint32_t highMicros[]) {
+	// One more than a response, for the rising edge of the line being pulled
+	// up on release which may be reported before the sensor answers.
+	uint64_t edges[DHT_EDGES + 1];
+	int edgeCount = 0;
+	int expected = DHT_EDGES;
+	uint32_t lastSeqno = 0;
+	union {
+		struct gpio_v2_line_event events[16];
+		uint8_t bytes[16 * sizeof(struct gpio_v2_line_event)];
+	} buff;
+	size_t filled = 0;
+	uint64_t deadline = monotonicNanos() + (uint64_t)timeoutMillis * 1000000;
+
+	while (edgeCount < expected) {
+		uint64_t now = monotonicNanos();
+		int waitMillis = (now < deadline) ? (int)((deadline - now + 999999) / 1000000) : 0;
+		if (edgeCount >= DHT_EDGES - 1 && waitMillis > RELEASE_TIMEOUT_MS) {
+			waitMillis = RELEASE_TIMEOUT_MS;
+		}
+		struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+		int ready = poll(&pfd, 1, waitMillis);
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ready <= 0) {
+			break;
+		}
+		ssize_t n = read(fd, buff.bytes + filled, sizeof(buff.bytes) - filled);
+		if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		filled += n;
+		size_t complete = filled / sizeof(struct gpio_v2_line_event);
+		size_t i;
+		for (i = 0; i < complete && edgeCount < expected; i++) {
+			const struct gpio_v2_line_event *e = &buff.events[i];
+			if (edgeCount == 0) {
+				if (e->id == GPIO_V2_LINE_EVENT_RISING_EDGE) {
+					expected = DHT_EDGES + 1;
+				}
+			} else if (e->line_seqno != lastSeqno + 1) {
+				// The kernel event buffer overflowed.
+				return GPIOCHIP_ERROR_SEQUENCE;
+			}
+			lastSeqno = e->line_seqno;
+			edges[edgeCount++] = e->timestamp_ns;
+		}
+		// Keep a partially read event for the next read.
+		size_t used = complete * sizeof(struct gpio_v2_line_event);
+		memmove(buff.bytes, buff.bytes + used, filled - used);
+		filled -= used;
+	}
+
+	// Align on the last edge, which releases the line at the end of the
+	// response.  Enabling edge detection can take longer than the 20-40 us the
+	// sensor waits before answering, so its first falling edge may be lost
+	// (or the pull-up edge takes its place).  That only affects the preamble
+	// low, which is then reported as 0.
+	if (edgeCount < DHT_EDGES - 1) {
+		return (edgeCount == 0) ? GPIOCHIP_ERROR_TIMEOUT : GPIOCHIP_ERROR_SEQUENCE;
+	}
+	bool preambleKnown = (edgeCount == expected);
+	if (edgeCount < DHT_EDGES) {
+		memmove(edges + 1, edges, edgeCount * sizeof(edges[0]));
+		edgeCount++;
+	}
+	const uint64_t *last = edges + edgeCount - DHT_EDGES;
+	int i;
+	for (i = 0; i <= DHT_PULSES; i++) {
+		lowMicros[i] = (i == 0 && !preambleKnown) ? 0 : nanosToMicros(last[2 * i + 1] - last[2 * i]);
+		if (i < DHT_PULSES) {
+			highMicros[i] = nanosToMicros(last[2 * i + 2] - last[2 * i + 1]);
+		}
+	}
+	return GPIOCHIP_SUCCESS;
+}
+
+static int gpiochip_capture(int pin, uint32_t lowMicros[], uint32_t highMicros[]) {
+	if (pin < 0 || pin >= GPIOCHIP_LINES || lineFds[pin] < 0) {
+		return GPIOCHIP_ERROR_REQUEST;
+	}
+	return dht_gpiochip_read_edges(lineFds[pin], CAPTURE_TIMEOUT_MS, lowMicros, highMicros);
+}
+
+const dht_backend_t dht_gpiochip_backend = {
+	.name = "gpiochip",
+	.init = gpiochip_init,
+	.set_input = gpiochip_set_input,
+	.set_output = gpiochip_set_output,
+	.set_high = gpiochip_set_high,
+	.set_low = gpiochip_set_low,
+	.input = gpiochip_input,
+	.timer_micros = gpiochip_timer_micros,
+	.timer_micros64 = gpiochip_timer_micros64,
+	.sleep_millis = sleep_milliseconds,
+	// The start pulse only has a minimum length, and edges are timestamped
+	// by the kernel, so there is no need to burn CPU for it.
+	.busy_wait_millis = sleep_milliseconds,
+	.capture = gpiochip_capture,
+};
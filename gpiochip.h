@@ -0,0 +1,35 @@
+// GPIO character device backend (/dev/gpiochipN, uAPI v2).
+//
+// Instead of busy polling the pin, the response of the sensor is captured as
+// kernel timestamped edge events on the line, so timings are not affected by
+// preemption of the reading process and no real time priority is needed.
+// Works with any GPIO driven by the kernel, including the RP1 of the Pi 5
+// and the gpio-sim module.
+#ifndef GPIOCHIP_H
+#define GPIOCHIP_H
+
+#include <stdint.h>
+
+#include "dht_backend.h"
+
+#define GPIOCHIP_SUCCESS 0
+#define GPIOCHIP_ERROR_OPEN -1
+#define GPIOCHIP_ERROR_REQUEST -2
+#define GPIOCHIP_ERROR_TIMEOUT -3
+#define GPIOCHIP_ERROR_SEQUENCE -4
+
+extern const dht_backend_t dht_gpiochip_backend;
+
+// Use (path) instead of /dev/gpiochip0.  Pin numbers are line offsets on this chip.
+// Must be called before the backend is initialized.
+void dht_gpiochip_set_device(const char *path);
+
+// Read edge events (struct gpio_v2_line_event) of one DHT response from (fd)
+// and convert them to pulse widths.  Leading rising edges, caused by the line
+// being pulled up on release, are skipped.  Gives up if the response is not
+// complete within (timeoutMillis).  (fd) may be a line request or any other
+// descriptor delivering events, such as a pipe in tests.
+// Returns GPIOCHIP_SUCCESS or a negative GPIOCHIP_ERROR_* value.
+int dht_gpiochip_read_edges(int fd, int timeoutMillis, uint32_t lowMicros[], uint32_t highMicros[]);
+
+#endif
@@ -20,6 +20,7 @@
 // SOFTWARE.
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,22 +30,64 @@
 #include <unistd.h>
 
 #include "bcm2708.h"
+#include "dht_backend.h"
+#include "dht_decode.h"
+#include "dht_model.h"
+#include "dht_trace.h"
 #include "realtime.h"
 #include "pi_dht_read.h"
 
-#define LOCKFILE "/run/lock/dht_read.lck"
+// Lock file of every pin, held while its sensor is read.
+#define LOCKFILE_FORMAT "/run/lock/dht_read.%d.lck"
 
-// Signal transition timeout in microsecond
-#define MAX_WAIT_US 400
+// Poll interval while waiting for a busy lock file.
+#define LOCK_POLL_MS 5
 
-// Number of bytes to expect from the DHT.
-// They are humidity high, humidity low, temp high, temp low and checksum.
-#define DHT_BYTES  5
+// Longest wait for a slot taken from another process.
+#define SHARED_SLOT_MAX_MILLIS 60000
 
-// Number of bit pulses to expect from the DHT.  Note that this is 41 because
-// the first pulse is a constant 80 microsecond pulse, with 40 pulses to represent
-// the data afterwards.
-#define DHT_PULSES (1 + DHT_BYTES * 8)
+// Length of the start signal pulling the line low.
+#define START_PULSE_MILLIS 20
+
+// The capture loops read the timer only every few line samples, enough
+// for about this long between reads, and when an edge is seen.
+#define SAMPLE_CHECK_NANOS 1000
+#define MAX_SAMPLES_PER_CHECK 64
+// Line reads timed to calibrate the samples per timer read.
+#define SAMPLE_CALIBRATION_READS 1000
+
+// Timer reads of the capture loop this far apart mean it was preempted.
+#define GAP_MICROS 5
+// Shortest data low and high a sensor sends, with some margin.  A gap
+// which may hide a whole pulse loses the read.
+#define MIN_LOW_MICROS 45
+#define MIN_HIGH_MICROS 22
+
+// Default timing profiles (DHT11, DHT22): the datasheet widths with room
+// for the spread between sensors, beyond which a pulse can't be decoded.
+static const dht_timing_profile_t defaultProfiles[2] = {
+	// DHT11: answers in 20-40 us, 80 us preamble, 50 us lows, 26-28 us
+	// highs for 0 and 70 us for 1.  Clones send lows of up to ~56 us.
+	{ { { 0, 100 }, { 60, 100 }, { 60, 100 }, { 35, 75 }, { 12, 90 } } },
+	// DHT22: answers in 20-200 us, 75-85 us preamble, 48-55 us lows,
+	// 22-30 us highs for 0 and 68-75 us for 1.
+	{ { { 0, 220 }, { 60, 100 }, { 60, 100 }, { 35, 70 }, { 12, 90 } } },
+};
+
+// Margin over the learned response delay a read waits for the response.
+#define DEFAULT_RESPONSE_MARGIN_MICROS 30
+
+// Data pulses may be this many learned standard deviations plus this
+// margin away from the learned widths (see dht_model.h), even beyond the
+// profile.  The model only learns from successful reads, so it never
+// narrows the windows: a drifting sensor must stay readable.
+#define LEARNED_WINDOW_SIGMAS 6
+#define LEARNED_WINDOW_MARGIN_MICROS 10
+
+// Phase ended by (edge), numbered as in dht_gap_t.
+static int edgePhase(int edge) {
+	return (edge < DHT_PHASE_DATA_LOW) ? edge : (edge & 1) ? DHT_PHASE_DATA_LOW : DHT_PHASE_DATA_HIGH;
+}
 
 static const char *getLogHeader() {
 	static char buff[] = "YYYY-MM-DDTHH:MM:SS dht_read: ";
@@ -63,63 +106,483 @@ static const char *getLogHeader() {
 
 #define DHT_READ_LOG(fmt, ...) printf("%s" fmt, getLogHeader(), ##__VA_ARGS__ )
 
+// Pins the library keeps state for, and dht_read_many() can read together:
+// those reported by input_all().
+#define DHT_PINS 32
 
-// Return time in microsecond when the (pin) input signal is changed to (transitionHigh).
-// Returns 0 if timeout. Otherwise non-zero microsecond is returned.
-static uint32_t getTransitionMicros(int pin, bool transitionHigh) {
-	uint32_t expectedValue = transitionHigh ? (1 << pin) : 0;
-	uint32_t startedMicros = pi_timer_micros();
-	while (pi_mmio_input(pin) != expectedValue) {
-		uint32_t elapsedMicros = pi_timer_micros() - startedMicros;
-		if (elapsedMicros >= MAX_WAIT_US) {
-			return 0; // Timeout!
+// Increment a dht_stats_t counter.  Reads may run in several threads.
+#define DHT_STAT_INC(field) __atomic_fetch_add(&stats.field, 1, __ATOMIC_RELAXED)
+
+static const dht_backend_t *backend = &pi_mmio_backend;
+static int maxBitFlips = 0;
+static bool preambleCalibration = false;
+static bool learnedTiming = true;
+static int maxRetries = 9;
+static int lockTimeoutMillis = 0;
+static dht_stats_t stats;
+
+// Line samples per timer read in the capture loops, calibrated for
+// (sampledBackend) on its first polled read.
+static const dht_backend_t *sampledBackend;
+static int samplesPerCheck = 1;
+
+// Time the line must have been idle high before the start signal, per
+// sensor type (DHT11, DHT22).
+static uint32_t prechargeMillis[2] = { 500, 500 };
+
+// Minimum time between two start signals, per sensor type (DHT11, DHT22).
+static uint32_t minIntervalMillis[2] = { 1000, 2000 };
+
+// Timing profile per sensor type (DHT11, DHT22).
+static dht_timing_profile_t timingProfiles[2] = { defaultProfiles[0], defaultProfiles[1] };
+static uint32_t responseMarginMicros = DEFAULT_RESPONSE_MARGIN_MICROS;
+
+typedef struct {
+	// Released by a previous read at idleSinceMicros (backend timer).
+	bool idle;
+	uint64_t idleSinceMicros;
+	// CLOCK_MONOTONIC nanoseconds from which the sensor may be started
+	// again, 0 if it wasn't yet.  Read by other threads for wait estimates.
+	// Also kept in the pin's lock file for other processes.
+	uint64_t nextSlotNanos;
+	// Lock file of the pin, valid while this process holds the lock.
+	int lockFd;
+	// Response delay learned for a sensor of responseType, 0 if none.
+	int responseType;
+	uint32_t responseMicros;
+} pin_state_t;
+
+static pin_state_t pinStates[DHT_PINS];
+
+void dht_set_max_bit_flips(int maxFlips) {
+	maxBitFlips = (maxFlips < 0) ? 0 : (maxFlips > 3) ? 3 : maxFlips;
+}
+
+void dht_set_preamble_calibration(int enable) {
+	preambleCalibration = (enable != 0);
+}
+
+void dht_set_learned_timing(int enable) {
+	learnedTiming = (enable != 0);
+}
+
+void dht_set_retries(int retries) {
+	maxRetries = (retries < 0) ? 0 : retries;
+}
+
+int dht_get_retries(void) {
+	return maxRetries;
+}
+
+void dht_set_precharge_millis(int type, uint32_t millis) {
+	prechargeMillis[type == DHT11 ? 0 : 1] = millis;
+}
+
+// Return how long (pin) still has to be driven high before the start signal
+// of a sensor of (type).
+static uint32_t prechargeRemainingMillis(int type, int pin) {
+	uint32_t millis = prechargeMillis[type == DHT11 ? 0 : 1];
+	if (pin >= 0 && pin < DHT_PINS && pinStates[pin].idle) {
+		uint64_t idleMillis = (backend->timer_micros64() - pinStates[pin].idleSinceMicros) / 1000;
+		millis = (idleMillis >= millis) ? 0 : millis - (uint32_t)idleMillis;
+	}
+	return millis;
+}
+
+void dht_set_min_interval_millis(int type, uint32_t millis) {
+	minIntervalMillis[type == DHT11 ? 0 : 1] = millis;
+}
+
+uint32_t dht_get_min_interval_millis(int type) {
+	return minIntervalMillis[type == DHT11 ? 0 : 1];
+}
+
+void dht_set_timing_profile(int type, const dht_timing_profile_t *profile) {
+	int index = (type == DHT11) ? 0 : 1;
+	timingProfiles[index] = (profile != NULL) ? *profile : defaultProfiles[index];
+}
+
+void dht_get_timing_profile(int type, dht_timing_profile_t *profile) {
+	*profile = timingProfiles[type == DHT11 ? 0 : 1];
+}
+
+void dht_set_response_margin_micros(uint32_t micros) {
+	responseMarginMicros = micros;
+}
+
+// Widen (window) to include (minMicros, maxMicros), which may be negative.
+static void widenWindow(dht_window_t *window, float minMicros, float maxMicros) {
+	if (minMicros < (float)window->minMicros) {
+		window->minMicros = (minMicros > 0.0f) ? (uint32_t)minMicros : 0;
+	}
+	if (maxMicros > (float)window->maxMicros) {
+		window->maxMicros = (uint32_t)maxMicros;
+	}
+}
+
+// Set the windows of the phases of a response of the sensor of (type) on
+// (pin): those of its profile, waiting for the response only the margin
+// over the delay learned for the pin, and widened to the data widths
+// learned for the sensor.
+static void getWindows(int type, int pin, dht_window_t windows[DHT_PHASES]) {
+	memcpy(windows, timingProfiles[type == DHT11 ? 0 : 1].phases, sizeof(dht_window_t) * DHT_PHASES);
+	if (pin >= 0 && pin < DHT_PINS && responseMarginMicros > 0 && pinStates[pin].responseType == type) {
+		uint32_t maxMicros = pinStates[pin].responseMicros + responseMarginMicros;
+		if (maxMicros < windows[DHT_PHASE_RESPONSE].maxMicros) {
+			windows[DHT_PHASE_RESPONSE].maxMicros = maxMicros;
 		}
 	}
-	uint32_t nowMicros = pi_timer_micros();
-	// If nowMicro is 0, which happens 1uS every 2^32 us(1 hour 11 minute 35 second),
-	// return maximum uint32 value, which is one microsecond earier time.
-	return (nowMicros == 0) ? UINT32_MAX : nowMicros;
+	dht_decode_widths_t widths;
+	if (learnedTiming && dht_model_get(type, pin, &widths)) {
+		float slack = LEARNED_WINDOW_MARGIN_MICROS;
+		widenWindow(&windows[DHT_PHASE_DATA_LOW],
+			widths.lowMicros - LEARNED_WINDOW_SIGMAS * widths.lowSigma - slack,
+			widths.lowMicros + LEARNED_WINDOW_SIGMAS * widths.lowSigma + slack);
+		widenWindow(&windows[DHT_PHASE_DATA_HIGH],
+			widths.zeroMicros - LEARNED_WINDOW_SIGMAS * widths.zeroSigma - slack,
+			widths.oneMicros + LEARNED_WINDOW_SIGMAS * widths.oneSigma + slack);
+	}
 }
 
-static int pi_dht_read(int type, int pin, float* pHumidity, float* pTemperature) {
-	*pTemperature = 0.0f;
-	*pHumidity = 0.0f;
+// Learn from a read of the sensor of (type) on (pin) which answered after
+// (responseMicros), or didn't answer in time if 0.  The delay follows later
+// answers at once and earlier ones slowly, and a missed answer widens it by
+// the margin.
+static void learnResponse(int type, int pin, uint32_t responseMicros) {
+	if (pin < 0 || pin >= DHT_PINS || responseMarginMicros == 0) {
+		return;
+	}
+	pin_state_t *state = &pinStates[pin];
+	if (responseMicros == 0) {
+		if (state->responseType == type) {
+			state->responseMicros += responseMarginMicros;
+		}
+	} else if (state->responseType != type || responseMicros >= state->responseMicros) {
+		state->responseType = type;
+		state->responseMicros = responseMicros;
+	} else {
+		state->responseMicros -= (state->responseMicros - responseMicros) / 8;
+	}
+}
 
-	// Store pulse widths that each DHT bit pulse is low and high.
-	// Make sure array is initialized to start at zero.
-	uint32_t lowMicros[DHT_PULSES + 1] = {0};
-	uint32_t highMicros[DHT_PULSES] = {0};
+// Real time priority for the capture, which only real lines need.
+static void raisePriority(void) {
+	if (!backend->in_process) {
+		set_max_priority();
+	}
+}
 
-	// Set pin to output.
-	pi_mmio_set_output(pin);
+static void restorePriority(void) {
+	if (!backend->in_process) {
+		set_default_priority();
+	}
+}
 
-	// Bump up process priority and change scheduler to try to try to make process more 'real time'.
-	set_max_priority();
+static uint64_t monotonicNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	// Set pin high for ~500 milliseconds.
-	pi_mmio_set_high(pin);
-	sleep_milliseconds(500);
+// Next slot of (pin) stored in its lock file by the last process reading
+// it, 0 if none.  CLOCK_MONOTONIC is the same for all processes, but
+// restarts on boot: a slot further ahead than SHARED_SLOT_MAX_MILLIS was
+// left before a reboot, in a lock directory which isn't a tmpfs.
+static uint64_t sharedSlotNanos(int pin) {
+	if (backend->in_process) {
+		return 0;
+	}
+	char filename[sizeof(LOCKFILE_FORMAT) + 10];
+	snprintf(filename, sizeof(filename), LOCKFILE_FORMAT, pin);
+	uint64_t slotNanos = 0;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (pread(fd, &slotNanos, sizeof(slotNanos), 0) != sizeof(slotNanos) ||
+				slotNanos > monotonicNanos() + (uint64_t)SHARED_SLOT_MAX_MILLIS * 1000000) {
+			slotNanos = 0;
+		}
+		close(fd);
+	}
+	return slotNanos;
+}
 
-	// The next calls are timing critical and care should be taken
-	// to ensure no unnecssary work is done below.
+// Set the next slot of (pin), locked by this process, to (slotNanos), and
+// return the previous one.
+static uint64_t storeSlot(int pin, uint64_t slotNanos) {
+	uint64_t previousNanos = __atomic_exchange_n(&pinStates[pin].nextSlotNanos, slotNanos, __ATOMIC_RELAXED);
+	if (!backend->in_process && pwrite(pinStates[pin].lockFd, &slotNanos, sizeof(slotNanos), 0) != sizeof(slotNanos)) {
+		// Lock file not writable by this user: other processes won't wait for
+		// this read, as before slots were shared.
+	}
+	return previousNanos;
+}
 
-	// Set pin low for ~20 milliseconds.
-	pi_mmio_set_low(pin);
-	busy_wait_milliseconds(20);
+// Take over a later slot of (pin), locked by this process, left by another
+// process.
+static void loadSlot(int pin) {
+	if (pin < 0 || pin >= DHT_PINS) {
+		return;
+	}
+	uint64_t slotNanos = sharedSlotNanos(pin);
+	if (slotNanos > __atomic_load_n(&pinStates[pin].nextSlotNanos, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&pinStates[pin].nextSlotNanos, slotNanos, __ATOMIC_RELAXED);
+	}
+}
 
-	// Set pin at input.
-	pi_mmio_set_input(pin);
+uint32_t dht_read_wait_millis(int pin) {
+	if (pin < 0 || pin >= DHT_PINS) {
+		return 0;
+	}
+	uint64_t slotNanos = __atomic_load_n(&pinStates[pin].nextSlotNanos, __ATOMIC_RELAXED);
+	uint64_t sharedNanos = sharedSlotNanos(pin);
+	slotNanos = (sharedNanos > slotNanos) ? sharedNanos : slotNanos;
+	uint64_t nowNanos = monotonicNanos();
+	return (slotNanos > nowNanos) ? (uint32_t)((slotNanos - nowNanos + 999999) / 1000000) : 0;
+}
+
+// Sleep until the sensor on (pin), locked by this process, may be started
+// again.
+static void waitForSlot(int pin) {
+	if (pin < 0 || pin >= DHT_PINS) {
+		return;
+	}
+	loadSlot(pin);
+	uint64_t slotNanos = __atomic_load_n(&pinStates[pin].nextSlotNanos, __ATOMIC_RELAXED);
+	if (slotNanos == 0) {
+		return;
+	}
+	struct timespec slot = { .tv_sec = slotNanos / 1000000000, .tv_nsec = slotNanos % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &slot, NULL) == EINTR) {
+	}
+}
+
+// The start pulse of the sensor of (type) on (pin) begins now.  Called
+// before the pulse, as storing the slot may write the lock file, which would
+// delay the capture after it.  Returns the slot it was started in, for
+// markUntriggered().
+static uint64_t markTriggered(int type, int pin) {
+	if (pin < 0 || pin >= DHT_PINS) {
+		return 0;
+	}
+	uint32_t millis = dht_get_min_interval_millis(type);
+	if (millis == 0) {
+		return storeSlot(pin, 0);
+	}
+	return storeSlot(pin, monotonicNanos() + (uint64_t)(START_PULSE_MILLIS + millis) * 1000000);
+}
+
+// The sensor of (type) on (pin) didn't answer the start signal within the
+// response window of (windows), so it isn't busy measuring: it may be started
+// again from its previous slot.  Only if the line was watched for the whole
+// window of the profile, since a sensor answering later than the window
+// learned for the pin is measuring all the same.
+static void markUntriggered(int type, int pin, const dht_window_t windows[DHT_PHASES], uint64_t slotNanos) {
+	uint32_t profileMicros = timingProfiles[type == DHT11 ? 0 : 1].phases[DHT_PHASE_RESPONSE].maxMicros;
+	if (pin >= 0 && pin < DHT_PINS && windows[DHT_PHASE_RESPONSE].maxMicros >= profileMicros) {
+		storeSlot(pin, slotNanos);
+	}
+}
+
+const char *dht_failure_name(dht_failure_t failure) {
+	static const char *const names[] = {
+		"success",
+		"init failed",
+		"pin locked",
+		"no response",
+		"pulse too long",
+		"pulse too short",
+		"gap may hide a pulse",
+		"capture failed",
+		"checksum error",
+	};
+	return ((unsigned)failure < sizeof(names) / sizeof(names[0])) ? names[failure] : "unknown";
+}
+
+// The read on (pin) is over: the sensor released the line, or will have
+// within a few milliseconds, and it is pulled up from now on.
+static void markIdle(int pin) {
+	if (pin >= 0 && pin < DHT_PINS) {
+		pinStates[pin].idle = true;
+		pinStates[pin].idleSinceMicros = backend->timer_micros64();
+	}
+}
+
+void dht_get_stats(dht_stats_t *pStats) {
+	pStats->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+	pStats->checksumErrors = __atomic_load_n(&stats.checksumErrors, __ATOMIC_RELAXED);
+	pStats->rescued = __atomic_load_n(&stats.rescued, __ATOMIC_RELAXED);
+	pStats->interrupted = __atomic_load_n(&stats.interrupted, __ATOMIC_RELAXED);
+	pStats->gapAborted = __atomic_load_n(&stats.gapAborted, __ATOMIC_RELAXED);
+	pStats->profiledReads = __atomic_load_n(&stats.profiledReads, __ATOMIC_RELAXED);
+	pStats->profiledInterrupted = __atomic_load_n(&stats.profiledInterrupted, __ATOMIC_RELAXED);
+}
+
+void dht_set_backend(const dht_backend_t *newBackend) {
+	backend = (newBackend != NULL) ? newBackend : &pi_mmio_backend;
+}
+
+const dht_backend_t *dht_get_backend(void) {
+	return backend;
+}
+
+// Busy wait for (micros) microsecond on the backend timer.
+static void sleepMicros(uint32_t micros) {
+	uint32_t startedMicros = backend->timer_micros();
+	while (backend->timer_micros() - startedMicros < micros) {
+	}
+}
+
+// Time line reads of (pin), and set how many the capture loops make
+// between two timer reads.  Timer and GPIO level reads cost about the same
+// on the Pi, so reading the timer for every sample halves the sampling rate.
+static void calibrateSampling(int pin) {
+	if (__atomic_load_n(&sampledBackend, __ATOMIC_ACQUIRE) == backend) {
+		return;
+	}
+	uint64_t startedMicros = backend->timer_micros64();
+	int i;
+	for (i = 0; i < SAMPLE_CALIBRATION_READS; i++) {
+		backend->input(pin);
+	}
+	uint64_t readNanos = (backend->timer_micros64() - startedMicros) * 1000 / SAMPLE_CALIBRATION_READS;
+	int samples = (readNanos == 0) ? MAX_SAMPLES_PER_CHECK : (int)(SAMPLE_CHECK_NANOS / readNanos);
+	samples = (samples < 1) ? 1 : (samples > MAX_SAMPLES_PER_CHECK) ? MAX_SAMPLES_PER_CHECK : samples;
+	__atomic_store_n(&samplesPerCheck, samples, __ATOMIC_RELAXED);
+	__atomic_store_n(&sampledBackend, backend, __ATOMIC_RELEASE);
+}
+
+// Progress of the polling capture of one sensor.
+typedef struct {
+	// Window of every phase (see getWindows()).
+	const dht_window_t *windows;
+	// Release of the line to the response low, 0 until seen.
+	uint32_t responseMicros;
+	// Line reads made.
+	uint32_t samples;
+	// Edge waited for, numbered as in dht_gap_t, and how late the previous
+	// one may have been seen.
+	int edge;
+	uint32_t lateMicros;
+	int gapCount;
+	dht_gap_t gaps[DHT_MAX_GAPS];
+	// Why the capture stopped at (edge).
+	dht_failure_t failure;
+} pin_poll_t;
 
+// Check a gap of the capture loop from (startMicros) to (nowMicros) in the
+// pulse which started at (sinceMicros), and record it if the edge waited for
+// was seen at its end.  Returns false if the read is lost: the gap may have
+// hidden a whole pulse, or there are more late edges than can be recorded.
+static bool recordGap(pin_poll_t *poll, uint32_t sinceMicros, uint32_t startMicros, uint32_t nowMicros, bool edgeSeen) {
+	uint32_t lengthMicros = nowMicros - startMicros;
+	// The pulse waited for ends in the gap at the earliest after its minimum
+	// width, counted from the earliest time its first edge may have been.
+	// Edges 2k+1 end a low, the others a high (or the idle line).
+	bool waitingRising = (poll->edge & 1);
+	uint32_t endMicros = sinceMicros - poll->lateMicros + (waitingRising ? MIN_LOW_MICROS : MIN_HIGH_MICROS);
+	uint32_t roomMicros = ((int32_t)(endMicros - startMicros) > 0) ? nowMicros - endMicros : lengthMicros;
+	// Without an edge seen the gap may hide the next pulse, with one the
+	// next two.
+	uint32_t hiddenMicros = waitingRising ? MIN_HIGH_MICROS : MIN_LOW_MICROS;
+	if (edgeSeen) {
+		hiddenMicros = MIN_LOW_MICROS + MIN_HIGH_MICROS;
+	}
+	if (((int32_t)roomMicros >= (int32_t)hiddenMicros) || (edgeSeen && poll->gapCount == DHT_MAX_GAPS)) {
+		DHT_READ_LOG("Gap of %u us waiting for edge %d\n", lengthMicros, poll->edge);
+		DHT_STAT_INC(gapAborted);
+		poll->failure = DHT_FAILURE_GAP;
+		return false;
+	}
+	if (edgeSeen) {
+		poll->lateMicros = lengthMicros;
+		dht_gap_t *gap = &poll->gaps[poll->gapCount++];
+		gap->edge = poll->edge;
+		gap->startMicros = startMicros;
+		gap->lengthMicros = lengthMicros;
+	}
+	return true;
+}
+
+// Wait for the (pin) input signal to change to (transitionHigh), and set
+// *pMicros to the time it did.  (sinceMicros) is the time of the previous
+// edge.  Returns false, with the reason in (poll), as soon as the pulse is
+// out of its phase window or a gap lost the read.  Widths are differences
+// of these 32 bit times, which are right across a timer wrap.
+static bool getTransitionMicros(int pin, bool transitionHigh, uint32_t sinceMicros, pin_poll_t *poll, uint32_t *pMicros) {
+	uint32_t expectedValue = transitionHigh ? (1 << pin) : 0;
+	const dht_window_t *window = &poll->windows[edgePhase(poll->edge)];
+	uint32_t startLateMicros = poll->lateMicros;
+	int perCheck = samplesPerCheck;
+	int untilCheck = perCheck;
+	uint32_t samples = 1;
+	// Time of the last timer read, and when the line was last known to be
+	// unchanged: just before that read, or after a gap only at its start.
+	uint32_t checkedMicros = sinceMicros;
+	uint32_t seenMicros = sinceMicros;
+	while (backend->input(pin) != expectedValue) {
+		samples++;
+		if (--untilCheck == 0) {
+			uint32_t nowMicros = backend->timer_micros();
+			if (nowMicros - checkedMicros < GAP_MICROS) {
+				seenMicros = nowMicros;
+			} else if (recordGap(poll, sinceMicros, checkedMicros, nowMicros, false)) {
+				seenMicros = checkedMicros;
+			} else {
+				poll->samples += samples;
+				return false;
+			}
+			if (seenMicros - sinceMicros > window->maxMicros) {
+				poll->failure = (poll->edge == 0) ? DHT_FAILURE_NO_RESPONSE : DHT_FAILURE_TIMEOUT;
+				poll->samples += samples;
+				return false;
+			}
+			checkedMicros = nowMicros;
+			untilCheck = perCheck;
+		}
+	}
+	uint32_t nowMicros = backend->timer_micros();
+	poll->samples += samples;
+	if (nowMicros - seenMicros < GAP_MICROS) {
+		poll->lateMicros = 0;
+	} else if (!recordGap(poll, sinceMicros, seenMicros, nowMicros, true)) {
+		return false;
+	}
+	// Late edges make the pulse look longer, and the next one shorter.
+	uint32_t widthMicros = nowMicros - sinceMicros;
+	if (widthMicros - poll->lateMicros > window->maxMicros) {
+		poll->failure = DHT_FAILURE_TIMEOUT;
+		return false;
+	}
+	if (widthMicros + startLateMicros < window->minMicros) {
+		poll->failure = DHT_FAILURE_SHORT_PULSE;
+		return false;
+	}
+	*pMicros = nowMicros;
+	poll->edge++;
+	return true;
+}
+
+// Poll the pin and record the pulse widths of the DHT response, and the
+// line reads and gaps in (poll).  Returns the number of widths recorded, in
+// the order lowMicros[0], highMicros[0], lowMicros[1]...
+// DHT_TRACE_DELTAS if complete, otherwise the reason is in (poll).
+static int capturePulses(int pin, uint32_t lowMicros[], uint32_t highMicros[], pin_poll_t *poll) {
 	// Need a very short delay before reading pins or else value is sometimes still low.
-	pi_timer_sleep_micros( 2 );
+	sleepMicros( 2 );
+	poll->responseMicros = 0;
+	poll->samples = 0;
+	poll->edge = 0;
+	poll->lateMicros = 0;
+	poll->gapCount = 0;
+	poll->failure = DHT_FAILURE_NONE;
 
 	// Wait for DHT to pull pin low.
-	uint32_t lowStartedUs = getTransitionMicros(pin, false);
-	if (lowStartedUs == 0) {
-		set_default_priority();
-		DHT_READ_LOG("Timeout waiting for response low\n");
+	uint32_t releasedUs = backend->timer_micros();
+	uint32_t lowStartedUs;
+	if (!getTransitionMicros(pin, false, releasedUs, poll, &lowStartedUs)) {
 		return 0;
 	}
+	poll->responseMicros = lowStartedUs - releasedUs;
 
 	// Record pulse widths for the expected result bits.
 	int i;
@@ -127,134 +590,583 @@ static int pi_dht_read(int type, int pin, float* pHumidity, float* pTemperature)
 	for (i=0; i < DHT_PULSES; i++) {
 
 		// Count how long pin is low and store in lowMicros[i]
-		highStartedUs = getTransitionMicros(pin, true);
-		if (highStartedUs == 0) {
-			set_default_priority();
-			DHT_READ_LOG("Timeout waiting for high[%d]\n", i);
-			return 0;
+		if (!getTransitionMicros(pin, true, lowStartedUs, poll, &highStartedUs)) {
+			return 2 * i;
 		}
 		lowMicros[i] = highStartedUs - lowStartedUs; 
 
 		// Count how long pin is high and store in highMicros[i]
-		lowStartedUs = getTransitionMicros(pin, false);
-		if (lowStartedUs == 0) {
-			set_default_priority();
-			DHT_READ_LOG("Timeout waiting for low[%d]\n", i);
-			return 0;
+		if (!getTransitionMicros(pin, false, highStartedUs, poll, &lowStartedUs)) {
+			return 2 * i + 1;
 		}
 		highMicros[i] = lowStartedUs - highStartedUs;
 	}
 	// Count how log pin is low and store the final lowMicros
-	highStartedUs = getTransitionMicros(pin, true);
-	if (highStartedUs == 0) {
-		// Timeout waiting for response.
-		set_default_priority();
-		DHT_READ_LOG("Timeout waiting for high[release]\n");
-		return 0;
+	if (!getTransitionMicros(pin, true, lowStartedUs, poll, &highStartedUs)) {
+		return 2 * DHT_PULSES;
 	}
 	lowMicros[DHT_PULSES] = highStartedUs - lowStartedUs; 
+	return DHT_TRACE_DELTAS;
+}
 
-	// Done with timing critical code, now interpret the results.
+// Clock the pulse widths are measured with, for traces.
+static int traceClock(void) {
+	if (backend == &pi_mmio_backend) {
+		return (int)pi_timer_source();
+	}
+	return (backend->capture != NULL) ? DHT_TRACE_CLOCK_EVENTS : DHT_TRACE_CLOCK_OTHER;
+}
 
-	// Drop back to normal priority.
-	set_default_priority();
+// Record the first (deltaCount) pulse widths of a capture and its outcome.
+static void tracePulses(int type, int pin, const uint32_t lowMicros[], const uint32_t highMicros[], int deltaCount,
+		const dht_result_t *pResult, int success) {
+	dht_trace_t trace;
+	trace.type = type;
+	trace.pin = pin;
+	trace.clock = traceClock();
+	trace.flags = (success ? DHT_TRACE_DECODED : 0) | (pResult->correctedBits > 0 ? DHT_TRACE_CORRECTED : 0);
+	trace.timestampNanos = (int64_t)pResult->timestamp.tv_sec * 1000000000 + pResult->timestamp.tv_nsec;
+	memcpy(trace.data, pResult->data, DHT_BYTES);
+	trace.deltaCount = deltaCount;
+	int i;
+	for (i = 0; i < deltaCount; i++) {
+		trace.deltas[i] = (i & 1) ? highMicros[i / 2] : lowMicros[i / 2];
+	}
+	trace.gapCount = pResult->gapCount;
+	for (i = 0; i < pResult->gapCount; i++) {
+		trace.gaps[i] = pResult->gaps[i];
+	}
+	dht_trace_record(&trace);
+}
 
-	uint32_t threshold = 0;
-	bool needAdjust = true;
-	while (needAdjust) {
-		// Compute the average low pulse width to use as a 50 microsecond reference threshold.
-		// Ignore the first reading because it is a constant 80 microsecond pulse.
-		threshold = 0;
-		for (i=1; i < DHT_PULSES; i++) {
-			threshold += lowMicros[i];
-		}
-		threshold /= DHT_PULSES-1;
-		uint32_t lowHighThreshold = threshold * 2;
-		
-		// Adjust high pulse widths for the interrupts
-		needAdjust = false;
-		for (i=1; i < DHT_PULSES; i++) {
-			// If the high width is less than the threshold...
-			if (highMicros[i] < threshold) {
-				uint32_t lowHigh = lowMicros[i] + highMicros[i];
-				// But the (low + high) width is equal to or more than the threshold...
-				if (lowHigh >= lowHighThreshold) {
-					// Interrupted during high detection. Add interrupt time to highMicors
-					DHT_READ_LOG("Adjusting bit[%d] : %u -> %u\n", i, highMicros[i], (highMicros[i] + lowMicros[i] - threshold));
-					highMicros[i] += lowMicros[i] - threshold;
-					lowMicros[i] = threshold;
-					needAdjust = true;
-				}
-			} else { // If the high width is equal or more than the threshold...
-				uint32_t lowHigh = highMicros[i] + lowMicros[i+1];
-				// But the (high+low) width is less than the threshold
-				if (lowHigh < lowHighThreshold) {
-					// Interrupted during low detection. Subtract interrupt time from highMicros.
-					DHT_READ_LOG("Adjusting bit[%d] : %u -> %u\n", i, highMicros[i], (highMicros[i] + lowMicros[i+1] - threshold));
-					highMicros[i] += lowMicros[i+1] - threshold;
-					lowMicros[i+1] = threshold;
-					needAdjust = true;
-				}
-			}
-		} // for adjust loop
-	} // while needAdjust
-
-	// Interpret each high pulse as a 0 or 1 by comparing it to the 50us reference.
-	// If the count is less than 50us it must be a ~28us 0 pulse, and if it's higher
-	// then it must be a ~70us 1 pulse.
-	uint8_t data[DHT_BYTES] = {0};
-	for (i=1; i < DHT_PULSES; i++) {
-		int index = (i-1)/8;
-		data[index] <<= 1;
-		if (highMicros[i] >= threshold) {
-			// One bit for long pulse.
-			data[index] |= 1;
+// Interpret the pulse widths captured from a sensor of (type), and set
+// the values in (pResult).  Returns 1 if successful, 0 if failed.
+static int decodePulses(int type, uint32_t lowMicros[], uint32_t highMicros[], dht_result_t *pResult) {
+	int i;
+	uint8_t *data = pResult->data;
+	dht_decode_info_t info;
+	dht_decode_widths_t widths;
+	// Preamble calibration is off by default, so enabling it takes precedence
+	// over the learned widths.
+	bool learned = !preambleCalibration && learnedTiming && dht_model_get(type, pResult->pin, &widths);
+	// Captures which recorded their gaps know which edges may be late.
+	int checksumOk = preambleCalibration
+		? dht_decode_preamble(lowMicros, highMicros, pResult->gaps, pResult->gapCount, data, &info)
+		: learned
+		? dht_decode_learned(lowMicros, highMicros, pResult->gaps, pResult->gapCount, &widths, data, &info)
+		: (pResult->gapCount >= 0)
+		? dht_decode_gaps(lowMicros, highMicros, pResult->gaps, pResult->gapCount, data, &info)
+		: dht_decode_linear(lowMicros, highMicros, data, &info);
+	pResult->adjustments = info.adjustments;
+	memcpy(pResult->bitMargins, info.bitMargins, sizeof(pResult->bitMargins));
+	bool profiled = (backend->capture == NULL && realtime_profile_active());
+	if (profiled) {
+		DHT_STAT_INC(profiledReads);
+	}
+	if (info.adjustments > 0) {
+		DHT_STAT_INC(interrupted);
+		if (profiled) {
+			DHT_STAT_INC(profiledInterrupted);
 		}
-		// Else zero bit for short pulse.
+		DHT_READ_LOG("Adjusted %d bits for interrupts\n", info.adjustments);
 	}
 
 	// Useful debug info:
 	//printf("Data: 0x%x 0x%x 0x%x 0x%x 0x%x\n", data[0], data[1], data[2], data[3], data[4]);
 
 	// Verify checksum of received data.
-	if (data[4] != ((data[0] + data[1] + data[2] + data[3]) & 0xFF)) {
+	if (!checksumOk) {
+		DHT_STAT_INC(checksumErrors);
+		int flips = dht_decode_correct(type, data, &info, maxBitFlips);
+		if (flips > 0) {
+			pResult->correctedBits = flips;
+			DHT_STAT_INC(rescued);
+			DHT_READ_LOG("Checksum error repaired by flipping %d bits\n", flips);
+			checksumOk = 1;
+		}
+	}
+	if (!checksumOk) {
 		DHT_READ_LOG("Checksum error\n");
 		for (i=0; i <DHT_PULSES; i++) DHT_READ_LOG("%2d,%4u,%4u\n", i, lowMicros[i], highMicros[i]);
 		DHT_READ_LOG("%2d,%4u\n", DHT_PULSES, lowMicros[DHT_PULSES]);
 		return 0;
 	}
+	// Repaired bits may be wrong, so only learn from clean reads.
+	if (learnedTiming && pResult->correctedBits == 0) {
+		dht_model_learn(type, pResult->pin, lowMicros, highMicros, data);
+	}
 	if (type == DHT11) {
 		// Get humidity and temp for DHT11 sensor.
-		*pHumidity = (float)data[0];
-		*pTemperature = (float)data[2];
+		pResult->humidity = (float)data[0];
+		pResult->temperature = (float)data[2];
 	} else if (type == DHT22) {
 		// Calculate humidity and temp for DHT22 sensor.
-		*pHumidity = (data[0] * 256 + data[1]) / 10.0f;
-		*pTemperature = ((data[2] & 0x7F) * 256 + data[3]) / 10.0f;
+		pResult->humidity = (data[0] * 256 + data[1]) / 10.0f;
+		pResult->temperature = ((data[2] & 0x7F) * 256 + data[3]) / 10.0f;
 		if (data[2] & 0x80) {
-			*pTemperature *= -1.0f;
+			pResult->temperature *= -1.0f;
 		}
 	}
 	return 1;
 }
 
-static int open_lockfile(const char *filename) {
-	int fd = open(filename, O_CREAT | O_RDONLY, 0600);
+static int pi_dht_read(int type, int pin, dht_result_t *pResult) {
+	pResult->temperature = 0.0f;
+	pResult->humidity = 0.0f;
+	pResult->adjustments = 0;
+	pResult->correctedBits = 0;
+
+	// Store pulse widths that each DHT bit pulse is low and high.
+	// Make sure array is initialized to start at zero.
+	uint32_t lowMicros[DHT_PULSES + 1] = {0};
+	uint32_t highMicros[DHT_PULSES] = {0};
+
+	// Backends capturing edges themselves (with kernel timestamps) don't need
+	// the busy polling below, nor real time priority for it.
+	bool polling = (backend->capture == NULL);
+
+	// Respect the minimum sampling period of the sensor.
+	waitForSlot(pin);
+
+	DHT_STAT_INC(reads);
+
+	// Set pin to output.
+	backend->set_output(pin);
+
+	// Bump up process priority and change scheduler to try to try to make process more 'real time'.
+	if (polling) {
+		raisePriority();
+		calibrateSampling(pin);
+	}
+
+	// Set pin high until it has been idle high long enough (~500 milliseconds
+	// unless released by a recent read).
+	backend->set_high(pin);
+	uint32_t prechargeMillis = prechargeRemainingMillis(type, pin);
+	if (prechargeMillis > 0) {
+		backend->sleep_millis(prechargeMillis);
+	}
+
+	if (backend->begin_start != NULL && backend->begin_start(1ull << pin) < 0) {
+		backend->set_input(pin);
+		if (polling) {
+			restorePriority();
+		}
+		markIdle(pin);
+		pResult->failure = DHT_FAILURE_LOCK;
+		DHT_READ_LOG("%s failed to lock pin %d for the start\n", backend->name, pin);
+		return 0;
+	}
+
+	uint64_t slotNanos = markTriggered(type, pin);
+	dht_window_t windows[DHT_PHASES];
+	getWindows(type, pin, windows);
+
+	// The next calls are timing critical and care should be taken
+	// to ensure no unnecssary work is done below.
+
+	// Set pin low for ~20 milliseconds.
+	backend->set_low(pin);
+	backend->busy_wait_millis(START_PULSE_MILLIS);
+
+	// Set pin at input.
+	backend->set_input(pin);
+	clock_gettime(CLOCK_REALTIME, &pResult->timestamp);
+	pResult->releasedMicros = backend->timer_micros64();
+
+	int deltaCount;
+	pin_poll_t poll = { .windows = windows, .samples = 0, .gapCount = -1, .failure = DHT_FAILURE_NONE };
+	if (polling) {
+		deltaCount = capturePulses(pin, lowMicros, highMicros, &poll);
+		// Done with timing critical code, drop back to normal priority.
+		restorePriority();
+	} else {
+		deltaCount = (backend->capture(pin, lowMicros, highMicros) == 0) ? DHT_TRACE_DELTAS : 0;
+		if (deltaCount == 0) {
+			poll.failure = DHT_FAILURE_CAPTURE;
+			DHT_READ_LOG("%s capture failed\n", backend->name);
+		}
+	}
+	pResult->failure = poll.failure;
+	pResult->failedEdge = (deltaCount == DHT_TRACE_DELTAS || !polling) ? -1 : poll.edge;
+	if (poll.failure == DHT_FAILURE_NO_RESPONSE) {
+		markUntriggered(type, pin, windows, slotNanos);
+		learnResponse(type, pin, 0);
+	}
+	if (polling && poll.failure != DHT_FAILURE_NONE) {
+		DHT_READ_LOG("Capture stopped at edge %d: %s\n", poll.edge, dht_failure_name(poll.failure));
+	}
+	pResult->captureMicros = (uint32_t)(backend->timer_micros64() - pResult->releasedMicros);
+	pResult->sampleNanos = (poll.samples == 0) ? 0 : (uint32_t)((uint64_t)pResult->captureMicros * 1000 / poll.samples);
+	pResult->gapCount = poll.gapCount;
+	int i;
+	for (i = 0; i < poll.gapCount; i++) {
+		pResult->gaps[i] = poll.gaps[i];
+		pResult->gaps[i].startMicros -= (uint32_t)pResult->releasedMicros;
+	}
+	markIdle(pin);
+	int success = (deltaCount == DHT_TRACE_DELTAS) && decodePulses(type, lowMicros, highMicros, pResult);
+	if (deltaCount == DHT_TRACE_DELTAS && !success) {
+		pResult->failure = DHT_FAILURE_CHECKSUM;
+	}
+	if (success && polling) {
+		learnResponse(type, pin, poll.responseMicros);
+	}
+	if (dht_trace_recording()) {
+		tracePulses(type, pin, lowMicros, highMicros, deltaCount, pResult, success);
+	}
+	return success;
+}
+
+// Response of one sensor being captured by capturePulsesMany().
+typedef struct {
+	dht_window_t windows[DHT_PHASES];
+	// Edges, gaps and failure, as for a single sensor.
+	pin_poll_t poll;
+	uint32_t lastEdgeMicros;
+	uint32_t lowMicros[DHT_PULSES + 1];
+	uint32_t highMicros[DHT_PULSES];
+} pin_capture_t;
+
+// Poll all pins in (pinMask) with one register read per sample, and record
+// the pulse widths and gaps of every response.  A pin is dropped as soon as
+// a pulse is out of its phase window or a gap lost its read, as in
+// getTransitionMicros().  The line reads made are counted in
+// *pSamples.  Returns the mask of the pins whose response was captured
+// completely.
+static uint32_t capturePulsesMany(uint32_t pinMask, pin_capture_t captures[DHT_PINS], uint32_t *pSamples) {
+	// Need a very short delay before reading pins or else value is sometimes still low.
+	sleepMicros( 2 );
+
+	uint32_t startedMicros = backend->timer_micros();
+	uint32_t startedPins = pinMask;
+	uint32_t pending = pinMask;
+	uint32_t waiting;
+	for (waiting = pinMask; waiting != 0; waiting &= waiting - 1) {
+		pin_capture_t *c = &captures[__builtin_ctz(waiting)];
+		c->poll.windows = c->windows;
+		c->poll.responseMicros = 0;
+		c->poll.samples = 0;
+		c->poll.edge = 0;
+		c->poll.lateMicros = 0;
+		c->poll.gapCount = 0;
+		c->poll.failure = DHT_FAILURE_NONE;
+		c->lastEdgeMicros = startedMicros;
+	}
+	// Released lines are high until the sensors answer.
+	uint32_t previous = pinMask;
+	int perCheck = samplesPerCheck;
+	uint32_t samples = 0;
+	uint32_t checkedMicros = startedMicros;
+	uint32_t seenMicros = startedMicros;
+	while (pending != 0) {
+		// Read the timer on an edge, or every perCheck samples for the timeouts.
+		uint32_t levels;
+		uint32_t changed;
+		int untilCheck = perCheck;
+		do {
+			levels = backend->input_all();
+			samples++;
+			changed = (levels ^ previous) & pending;
+		} while (changed == 0 && --untilCheck > 0);
+		uint32_t nowMicros = backend->timer_micros();
+		previous = levels;
+		// Edges seen now happened after the lines were last known to be
+		// unchanged: just before the previous timer read, or after a gap of
+		// the loop only at its start.
+		bool edgeGap = (nowMicros - seenMicros >= GAP_MICROS);
+		uint32_t edgeSinceMicros = seenMicros;
+		// Lines without an edge may have hidden one in a gap since the
+		// previous timer read.
+		bool checkGap = (nowMicros - checkedMicros >= GAP_MICROS);
+		uint32_t checkSinceMicros = checkedMicros;
+		seenMicros = checkGap ? checkedMicros : nowMicros;
+		checkedMicros = nowMicros;
+		for (waiting = pending; waiting != 0; waiting &= waiting - 1) {
+			int pin = __builtin_ctz(waiting);
+			pin_capture_t *c = &captures[pin];
+			pin_poll_t *poll = &c->poll;
+			if (!(changed & (1u << pin))) {
+				if (checkGap && !recordGap(poll, c->lastEdgeMicros, checkSinceMicros, nowMicros, false)) {
+					pending &= ~(1u << pin);
+					pinMask &= ~(1u << pin);
+				} else if ((int32_t)(seenMicros - c->lastEdgeMicros) > (int32_t)c->windows[edgePhase(poll->edge)].maxMicros) {
+					poll->failure = (poll->edge == 0) ? DHT_FAILURE_NO_RESPONSE : DHT_FAILURE_TIMEOUT;
+					pending &= ~(1u << pin);
+					pinMask &= ~(1u << pin);
+				}
+				continue;
+			}
+			uint32_t startLateMicros = poll->lateMicros;
+			if (!edgeGap) {
+				poll->lateMicros = 0;
+			} else if (!recordGap(poll, c->lastEdgeMicros, edgeSinceMicros, nowMicros, true)) {
+				pending &= ~(1u << pin);
+				pinMask &= ~(1u << pin);
+				continue;
+			}
+			uint32_t width = nowMicros - c->lastEdgeMicros;
+			// Edge 2k+1 (rising) ends low pulse k, edge 2k+2 (falling) ends
+			// high pulse k.  Edge 0 starts the preamble.
+			int edge = poll->edge;
+			const dht_window_t *window = &c->windows[edgePhase(edge)];
+			if (width - poll->lateMicros > window->maxMicros || width + startLateMicros < window->minMicros) {
+				poll->failure = (width - poll->lateMicros > window->maxMicros) ? DHT_FAILURE_TIMEOUT : DHT_FAILURE_SHORT_PULSE;
+				pending &= ~(1u << pin);
+				pinMask &= ~(1u << pin);
+				continue;
+			}
+			poll->edge++;
+			if (edge & 1) {
+				c->lowMicros[edge / 2] = width;
+			} else if (edge > 0) {
+				c->highMicros[edge / 2 - 1] = width;
+			} else {
+				poll->responseMicros = width;
+			}
+			c->lastEdgeMicros = nowMicros;
+			if (poll->edge == DHT_EDGES) {
+				pending &= ~(1u << pin);
+			}
+		}
+	}
+	for (waiting = startedPins & ~pinMask; waiting != 0; waiting &= waiting - 1) {
+		int pin = __builtin_ctz(waiting);
+		DHT_READ_LOG("Capture on pin %d stopped at edge %d: %s\n", pin, captures[pin].poll.edge,
+			dht_failure_name(captures[pin].poll.failure));
+	}
+	*pSamples = samples;
+	return pinMask;
+}
+
+// Read the sensors (types, pins) selected by the index mask (which) in a
+// single cycle, and set results[] of each.  Returns the index mask of the
+// successful reads.
+static uint32_t pi_dht_read_many(const int types[], const int pins[], uint32_t which, dht_result_t results[]) {
+	static pin_capture_t captures[DHT_PINS];
+	bool polling = (backend->capture == NULL);
+	uint32_t pinMask = 0;
+	uint32_t rest;
+	int i;
+	// Start when the last sensor to become ready may be started.
+	int latestPin = pins[__builtin_ctz(which)];
+	for (rest = which; rest != 0; rest &= rest - 1) {
+		i = __builtin_ctz(rest);
+		loadSlot(pins[i]);
+		if (pinStates[pins[i]].nextSlotNanos > pinStates[latestPin].nextSlotNanos) {
+			latestPin = pins[i];
+		}
+	}
+	waitForSlot(latestPin);
+	for (rest = which; rest != 0; rest &= rest - 1) {
+		i = __builtin_ctz(rest);
+		results[i].temperature = 0.0f;
+		results[i].humidity = 0.0f;
+		results[i].adjustments = 0;
+		results[i].correctedBits = 0;
+		results[i].gapCount = -1;
+		results[i].failure = DHT_FAILURE_NONE;
+		results[i].failedEdge = -1;
+		getWindows(types[i], pins[i], captures[pins[i]].windows);
+		pinMask |= 1u << pins[i];
+		DHT_STAT_INC(reads);
+		backend->set_output(pins[i]);
+	}
+
+	if (polling) {
+		raisePriority();
+		calibrateSampling(pins[__builtin_ctz(which)]);
+	}
+
+	// Same start sequence as pi_dht_read(), on all pins together.
+	uint32_t prechargeMillis = 0;
+	for (rest = which; rest != 0; rest &= rest - 1) {
+		i = __builtin_ctz(rest);
+		backend->set_high(pins[i]);
+		uint32_t millis = prechargeRemainingMillis(types[i], pins[i]);
+		prechargeMillis = (millis > prechargeMillis) ? millis : prechargeMillis;
+	}
+	if (prechargeMillis > 0) {
+		backend->sleep_millis(prechargeMillis);
+	}
+	if (backend->begin_start != NULL && backend->begin_start(pinMask) < 0) {
+		for (rest = which; rest != 0; rest &= rest - 1) {
+			i = __builtin_ctz(rest);
+			backend->set_input(pins[i]);
+			markIdle(pins[i]);
+			results[i].failure = DHT_FAILURE_LOCK;
+		}
+		if (polling) {
+			restorePriority();
+		}
+		DHT_READ_LOG("%s failed to lock the pins for the start\n", backend->name);
+		return 0;
+	}
+	uint64_t slotNanos[DHT_PINS];
+	for (rest = which; rest != 0; rest &= rest - 1) {
+		i = __builtin_ctz(rest);
+		slotNanos[i] = markTriggered(types[i], pins[i]);
+	}
+	for (rest = which; rest != 0; rest &= rest - 1) {
+		backend->set_low(pins[__builtin_ctz(rest)]);
+	}
+	backend->busy_wait_millis(START_PULSE_MILLIS);
+	for (rest = which; rest != 0; rest &= rest - 1) {
+		backend->set_input(pins[__builtin_ctz(rest)]);
+	}
+	struct timespec timestamp;
+	clock_gettime(CLOCK_REALTIME, &timestamp);
+	uint64_t releasedMicros = backend->timer_micros64();
+
+	uint32_t captured = 0;
+	if (polling) {
+		uint32_t samples = 0;
+		uint32_t capturedPins = capturePulsesMany(pinMask, captures, &samples);
+		uint32_t sampleNanos = (samples == 0) ? 0 : (uint32_t)((backend->timer_micros64() - releasedMicros) * 1000 / samples);
+		restorePriority();
+		for (rest = which; rest != 0; rest &= rest - 1) {
+			i = __builtin_ctz(rest);
+			pin_capture_t *c = &captures[pins[i]];
+			results[i].sampleNanos = sampleNanos;
+			results[i].failure = c->poll.failure;
+			if (capturedPins & (1u << pins[i])) {
+				captured |= 1u << i;
+				results[i].captureMicros = c->lastEdgeMicros - (uint32_t)releasedMicros;
+			} else {
+				results[i].failedEdge = c->poll.edge;
+			}
+			results[i].gapCount = c->poll.gapCount;
+			int j;
+			for (j = 0; j < c->poll.gapCount; j++) {
+				results[i].gaps[j] = c->poll.gaps[j];
+				results[i].gaps[j].startMicros -= (uint32_t)releasedMicros;
+			}
+			if (c->poll.failure == DHT_FAILURE_NO_RESPONSE) {
+				markUntriggered(types[i], pins[i], c->windows, slotNanos[i]);
+				learnResponse(types[i], pins[i], 0);
+			}
+		}
+	} else {
+		// Edges are timestamped and queued by the backend, so the responses
+		// can be collected one after the other.
+		for (rest = which; rest != 0; rest &= rest - 1) {
+			i = __builtin_ctz(rest);
+			pin_capture_t *c = &captures[pins[i]];
+			if (backend->capture(pins[i], c->lowMicros, c->highMicros) == 0) {
+				captured |= 1u << i;
+			} else {
+				results[i].failure = DHT_FAILURE_CAPTURE;
+				DHT_READ_LOG("%s capture failed on pin %d\n", backend->name, pins[i]);
+			}
+			results[i].captureMicros = (uint32_t)(backend->timer_micros64() - releasedMicros);
+		}
+	}
+
+	uint32_t succeeded = 0;
+	for (rest = which; rest != 0; rest &= rest - 1) {
+		i = __builtin_ctz(rest);
+		markIdle(pins[i]);
+		results[i].timestamp = timestamp;
+		results[i].releasedMicros = releasedMicros;
+		pin_capture_t *c = &captures[pins[i]];
+		int success = (captured & (1u << i)) && decodePulses(types[i], c->lowMicros, c->highMicros, &results[i]);
+		if (success) {
+			succeeded |= 1u << i;
+			if (polling) {
+				learnResponse(types[i], pins[i], c->poll.responseMicros);
+			}
+		} else if (captured & (1u << i)) {
+			results[i].failure = DHT_FAILURE_CHECKSUM;
+		}
+		if (dht_trace_recording()) {
+			int deltaCount = (captured & (1u << i)) ? DHT_TRACE_DELTAS : (polling && c->poll.edge > 1) ? c->poll.edge - 1 : 0;
+			tracePulses(types[i], pins[i], c->lowMicros, c->highMicros, deltaCount, &results[i], success);
+		}
+	}
+	return succeeded;
+}
+
+void dht_set_lock_timeout_millis(int millis) {
+	lockTimeoutMillis = (millis < 0) ? -1 : millis;
+}
+
+// Locks of the pins of in-process backends, which other processes can't
+// read.
+static pthread_mutex_t localLocks[DHT_PINS] = { [0 ... DHT_PINS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+static int lockLocal(int pin) {
+	if (pin < 0 || pin >= DHT_PINS) {
+		return 0;
+	}
+	if (lockTimeoutMillis < 0) {
+		pthread_mutex_lock(&localLocks[pin]);
+		return 0;
+	}
+	int waitedMillis = 0;
+	while (pthread_mutex_trylock(&localLocks[pin]) != 0) {
+		if (waitedMillis >= lockTimeoutMillis) {
+			printf("Pin %d is in use\n", pin);
+			return -1;
+		}
+		sleep_milliseconds(LOCK_POLL_MS);
+		waitedMillis += LOCK_POLL_MS;
+	}
+	return 0;
+}
+
+// Lock the sensor on (pin) against reads by other threads and processes,
+// waiting up to the lock timeout.  Returns the lock file descriptor, or -1.
+// In-process backends only lock against other threads, with a mutex, and
+// return 0.
+static int open_lockfile(int pin) {
+	if (backend->in_process) {
+		return lockLocal(pin);
+	}
+	char filename[sizeof(LOCKFILE_FORMAT) + 10];
+	snprintf(filename, sizeof(filename), LOCKFILE_FORMAT, pin);
+	// Readable by all, so users without root (/dev/gpiomem) can lock it too.
+	// Writable by its owner, who keeps the pin's next slot in it.
+	int fd = open(filename, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0 && errno == EACCES) {
+		fd = open(filename, O_RDONLY | O_CLOEXEC);
+	}
 	if (fd < 0) {
 		printf("Failed to access lock file: %s\nerror: %s\n", filename, strerror(errno));
 		return -1;
 	}
-	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+	int result;
+	if (lockTimeoutMillis < 0) {
+		while ((result = flock(fd, LOCK_EX)) == -1 && errno == EINTR) {
+		}
+	} else {
+		int waitedMillis = 0;
+		while ((result = flock(fd, LOCK_EX | LOCK_NB)) == -1 && errno == EWOULDBLOCK &&
+				waitedMillis < lockTimeoutMillis) {
+			sleep_milliseconds(LOCK_POLL_MS);
+			waitedMillis += LOCK_POLL_MS;
+		}
+	}
+	if (result == -1) {
 		if(errno == EWOULDBLOCK) {
 			printf("Lock file is in use\n");
 		}
 		perror("Flock failed");
+		close(fd);
 		return -1;
 	}
+	if (pin >= 0 && pin < DHT_PINS) {
+		pinStates[pin].lockFd = fd;
+	}
 	return fd;
 }
 
-static void close_lockfile(int fd) {
+static void close_lockfile(int pin, int fd) {
+	if (backend->in_process) {
+		if (pin >= 0 && pin < DHT_PINS) {
+			pthread_mutex_unlock(&localLocks[pin]);
+		}
+		return;
+	}
 	if(flock(fd, LOCK_UN) == -1) {
 		perror("Failed to unlock file");
 	}
@@ -263,35 +1175,174 @@ static void close_lockfile(int fd) {
 	}
 }
 
-int dht_read(int type, int pin, float *pHumidity, float *pTemperature) {
+// Lock the pins in (pinMask) in increasing order, so callers locking
+// overlapping sets can't deadlock.  Returns 0 with all locks held in
+// (lockFds), or -1 with none.
+static int lockPins(uint32_t pinMask, int lockFds[DHT_PINS]) {
+	uint32_t rest;
+	for (rest = pinMask; rest != 0; rest &= rest - 1) {
+		int pin = __builtin_ctz(rest);
+		lockFds[pin] = open_lockfile(pin);
+		if (lockFds[pin] < 0) {
+			uint32_t locked;
+			for (locked = pinMask & ~rest; locked != 0; locked &= locked - 1) {
+				close_lockfile(__builtin_ctz(locked), lockFds[__builtin_ctz(locked)]);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void unlockPins(uint32_t pinMask, const int lockFds[DHT_PINS]) {
+	for (; pinMask != 0; pinMask &= pinMask - 1) {
+		close_lockfile(__builtin_ctz(pinMask), lockFds[__builtin_ctz(pinMask)]);
+	}
+}
+
+// Read the sensor (type) on (pin), and again up to (retries) times after a
+// failed read.
+static int readRetrying(int type, int pin, int retries, dht_result_t *pResult) {
 	int success = 0;
-	// Validate humidity and temperature arguments and set them to zero.
-	if (pHumidity == NULL || pTemperature == NULL) {
+	// Validate result argument and set it to zero.
+	if (pResult == NULL) {
 		DHT_READ_LOG("bad argument\n");
-	} else 
+		return 0;
+	}
+	memset(pResult, 0, sizeof(*pResult));
+	pResult->type = type;
+	pResult->pin = pin;
+	pResult->failedEdge = -1;
 	// Initialize GPIO library.
-	if (pi_mmio_init() < 0) {
-		DHT_READ_LOG("MMIO init failed. May not be root\n");
+	if (backend->init() < 0) {
+		pResult->failure = DHT_FAILURE_INIT;
+		DHT_READ_LOG("%s init failed. May not be root\n", backend->name);
 	} else {
 		int lockfd = -1;
-		int count = 10;
+		int count = retries + 1;
+		int attempts = 0;
 		while (count-- > 0) {
 			if (lockfd < 0) {
-				lockfd = open_lockfile(LOCKFILE);
+				lockfd = open_lockfile(pin);
 			}
 			if (lockfd >= 0) {
-				success = pi_dht_read(type, pin, pHumidity, pTemperature);
+				pResult->retries = attempts++;
+				success = pi_dht_read(type, pin, pResult);
 				if (success) {
 					count = 0;
 				}
+			} else if (lockTimeoutMillis != 0) {
+				count = 0; // already waited for the lock as long as allowed
 			}
-			if (count > 0) {
-				sleep(1); // wait 1 sec to refresh
+			if (count > 0 && lockfd < 0) {
+				sleep(1); // wait 1 sec for the lock
 			}
 		} // while count > 0
 		if (lockfd >= 0) {
-			close_lockfile(lockfd);
+			close_lockfile(pin, lockfd);
+		} else {
+			pResult->failure = DHT_FAILURE_LOCK;
 		}
 	} // successfully initialized GPIO library
+	pResult->success = success;
+	return success;
+}
+
+int dht_read_ex(int type, int pin, dht_result_t *pResult) {
+	return readRetrying(type, pin, maxRetries, pResult);
+}
+
+int dht_read_once(int type, int pin, dht_result_t *pResult) {
+	return readRetrying(type, pin, 0, pResult);
+}
+
+int dht_read_many(int count, const int types[], const int pins[], dht_result_t results[]) {
+	// Validate arguments: distinct pins, all reported by one input_all().
+	uint32_t pinMask = 0;
+	int i;
+	bool valid = (count > 0 && count <= DHT_PINS && types != NULL && pins != NULL && results != NULL);
+	for (i = 0; valid && i < count; i++) {
+		valid = (pins[i] >= 0 && pins[i] < DHT_PINS && !(pinMask & (1u << pins[i])));
+		pinMask |= 1u << pins[i];
+	}
+	if (!valid) {
+		DHT_READ_LOG("bad argument\n");
+		return 0;
+	}
+	// Backends which can neither sample all pins at once nor capture edges
+	// on their own read one sensor after the other.
+	if (backend->input_all == NULL && backend->capture == NULL) {
+		int successes = 0;
+		for (i = 0; i < count; i++) {
+			successes += dht_read_ex(types[i], pins[i], &results[i]);
+		}
+		return successes;
+	}
+	for (i = 0; i < count; i++) {
+		memset(&results[i], 0, sizeof(results[i]));
+		results[i].type = types[i];
+		results[i].pin = pins[i];
+		results[i].failedEdge = -1;
+	}
+	// Index mask of the sensors still to be read.
+	uint32_t which = (count == 32) ? UINT32_MAX : (1u << count) - 1;
+	// Initialize GPIO library.
+	dht_failure_t failure = DHT_FAILURE_NONE;
+	if (backend->init() < 0) {
+		failure = DHT_FAILURE_INIT;
+		DHT_READ_LOG("%s init failed. May not be root\n", backend->name);
+	} else {
+		int lockFds[DHT_PINS];
+		bool locked = false;
+		int rounds = maxRetries + 1;
+		int attempts = 0;
+		while (rounds-- > 0) {
+			if (!locked) {
+				locked = (lockPins(pinMask, lockFds) == 0);
+			}
+			if (locked) {
+				uint32_t rest;
+				for (rest = which; rest != 0; rest &= rest - 1) {
+					results[__builtin_ctz(rest)].retries = attempts;
+				}
+				attempts++;
+				which &= ~pi_dht_read_many(types, pins, which, results);
+				if (which == 0) {
+					rounds = 0;
+				}
+			} else if (lockTimeoutMillis != 0) {
+				rounds = 0; // already waited for the locks as long as allowed
+			}
+			if (rounds > 0 && !locked) {
+				sleep(1); // wait 1 sec for the locks
+			}
+		} // while rounds > 0
+		if (locked) {
+			unlockPins(pinMask, lockFds);
+		} else {
+			failure = DHT_FAILURE_LOCK;
+		}
+	} // successfully initialized GPIO library
+	int successes = 0;
+	for (i = 0; i < count; i++) {
+		results[i].success = !(which & (1u << i));
+		successes += results[i].success;
+		if (failure != DHT_FAILURE_NONE) {
+			results[i].failure = failure;
+		}
+	}
+	return successes;
+}
+
+int dht_read(int type, int pin, float *pHumidity, float *pTemperature) {
+	// Validate humidity and temperature arguments.
+	if (pHumidity == NULL || pTemperature == NULL) {
+		DHT_READ_LOG("bad argument\n");
+		return 0;
+	}
+	dht_result_t result;
+	int success = dht_read_ex(type, pin, &result);
+	*pHumidity = result.humidity;
+	*pTemperature = result.temperature;
 	return success;
 }
@@ -21,11 +21,81 @@
 #ifndef PI_DHT_READ_H
 #define PI_DHT_READ_H
 
+#include <stdint.h>
+#include <time.h>
+
 // Define sensor types.
 #define DHT11 11
 #define DHT22 22
 #define AM2302 22
 
+// Number of bytes to expect from the DHT.
+// They are humidity high, humidity low, temp high, temp low and checksum.
+#define DHT_BYTES  5
+
+// Number of bit pulses to expect from the DHT.  Note that this is 41 because
+// the first pulse is a constant 80 microsecond pulse, with 40 pulses to represent
+// the data afterwards.
+#define DHT_PULSES (1 + DHT_BYTES * 8)
+
+// Number of edges of a response: the falling and rising edge of every low
+// pulse, numbered as in dht_gap_t.
+#define DHT_EDGES (2 * (DHT_PULSES + 1))
+
+// Late edges a capture records before giving up on the read.
+#define DHT_MAX_GAPS 16
+
+// The capture loop was preempted: two of its consecutive timer reads were
+// lengthMicros apart, and an edge was seen right after, so it happened at
+// some time during the gap.
+typedef struct {
+	// Edges are numbered from 0 (start of the response): edge 2k+1 ends
+	// low pulse k, edge 2k+2 ends high pulse k.
+	int edge;
+	// Start of the gap after the line was released, and its length.
+	uint32_t startMicros;
+	uint32_t lengthMicros;
+} dht_gap_t;
+
+// Phases of a response, each ended by an edge: phase (edge) for edges 0-2,
+// then data low for odd and data high for even edges.
+enum {
+	DHT_PHASE_RESPONSE,		// Release of the line to the response low.
+	DHT_PHASE_PREAMBLE_LOW,
+	DHT_PHASE_PREAMBLE_HIGH,
+	DHT_PHASE_DATA_LOW,		// Also the final low releasing the line.
+	DHT_PHASE_DATA_HIGH,		// 0 and 1 bits.
+	DHT_PHASES
+};
+
+// Range of widths a pulse may have, in microseconds.
+typedef struct {
+	uint32_t minMicros;
+	uint32_t maxMicros;
+} dht_window_t;
+
+// Timing of the response of a sensor type.  A polling capture stops as soon
+// as a pulse is out of the window of its phase.
+typedef struct {
+	dht_window_t phases[DHT_PHASES];
+} dht_timing_profile_t;
+
+// Why a read failed.
+typedef enum {
+	DHT_FAILURE_NONE = 0,
+	DHT_FAILURE_INIT,		// The backend could not be initialized (not root?).
+	DHT_FAILURE_LOCK,		// A pin or GPIO register lock file could not be locked.
+	DHT_FAILURE_NO_RESPONSE,	// The sensor didn't answer the start signal.
+	DHT_FAILURE_TIMEOUT,		// A pulse was longer than the spec allows.
+	DHT_FAILURE_SHORT_PULSE,	// A pulse was shorter than the spec allows.
+	DHT_FAILURE_GAP,		// A preemption may have hidden a whole pulse.
+	DHT_FAILURE_CAPTURE,		// The backend's own capture failed.
+	DHT_FAILURE_CHECKSUM,		// The data failed the checksum and couldn't be repaired.
+} dht_failure_t;
+
+// Short description of (failure) for log messages.
+const char *dht_failure_name(dht_failure_t failure);
+
 /**
  * Read humidity/temperature from Adafruit DHT sensor, with retries.
  *
@@ -37,4 +107,212 @@
  */
 int dht_read(int type, int pin, float *pHumidity, float *pTemperature);
 
+// Detailed outcome of dht_read_ex().
+typedef struct {
+	int type;
+	int pin;
+	// 1 if the values below are valid, 0 if the read failed.
+	int success;
+	// Why the reported read failed, and the edge the capture stopped at
+	// (numbered as in dht_gap_t), -1 if it didn't.
+	dht_failure_t failure;
+	int failedEdge;
+	float humidity;
+	float temperature;
+	// Raw bytes as received (after any correction), checksum last.
+	uint8_t data[DHT_BYTES];
+	// Per data bit, measured high width minus the 0/1 threshold in
+	// microseconds.  Values near zero are marginal bits.
+	int16_t bitMargins[DHT_PULSES - 1];
+	// Bits corrected for interrupts during the capture.
+	int adjustments;
+	// Bits flipped to repair the checksum (see dht_set_max_bit_flips()).
+	int correctedBits;
+	// Reads attempted before the one reported here.
+	int retries;
+	// Time from releasing the line to the end of the capture.
+	uint32_t captureMicros;
+	// Average time between two samples of the line during the capture, the
+	// resolution of the pulse widths.  0 if the backend timestamps edges.
+	uint32_t sampleNanos;
+	// Edges delayed by preemptions of a polling capture, -1 if not known.
+	int gapCount;
+	dht_gap_t gaps[DHT_MAX_GAPS];
+	// Wall clock time the line was released for the reported read.
+	struct timespec timestamp;
+	// The same instant on the 64 bit backend timer (the system timer with
+	// the MMIO backend), which doesn't wrap, to line reads up with other
+	// recordings of that timer.
+	uint64_t releasedMicros;
+} dht_result_t;
+
+/**
+ * Read humidity/temperature from Adafruit DHT sensor, with retries, and
+ * report how the read went.
+ *
+ * @param type Sensor type. (ex. AM2302)
+ * @param pin GPIO pin number. (ex. 4)
+ * @param pResult Pointer to struct where the result is set on return.
+ * @return 1 if successful. 0 if failed.
+ */
+int dht_read_ex(int type, int pin, dht_result_t *pResult);
+
+/**
+ * Read like dht_read_ex(), but only once whatever dht_set_retries() says,
+ * for callers scheduling their own retries.
+ *
+ * @param type Sensor type. (ex. AM2302)
+ * @param pin GPIO pin number. (ex. 4)
+ * @param pResult Pointer to struct where the result is set on return.
+ * @return 1 if successful. 0 if failed.
+ */
+int dht_read_once(int type, int pin, dht_result_t *pResult);
+
+/**
+ * Read several sensors on different pins together: all are woken up at
+ * once and their responses captured in the same pass, so reading N sensors
+ * takes about as long as reading one.  Failed reads are retried like
+ * dht_read_ex() does, again together.
+ *
+ * @param count Number of sensors, up to 32.
+ * @param types Sensor type of each sensor.
+ * @param pins Distinct GPIO pin number, 0-31, of each sensor.
+ * @param results Array of (count) structs where the result of each sensor,
+ *        including its success, is set on return.
+ * @return Number of successful reads.
+ */
+int dht_read_many(int count, const int types[], const int pins[], dht_result_t results[]);
+
+/**
+ * Set how many of the least confident bits may be flipped to repair a read
+ * failing the checksum, instead of discarding it.
+ *
+ * A repaired read matches its checksum but not always the sensor: the one
+ * byte checksum can't tell which flip was right.  On the benchmark's noisy
+ * DHT22 responses, 2 flips accept about 4 times as many wrong readings as
+ * none (0.36% against 0.09%), and up to 11-14% against 1.5-2.5% with a slowly
+ * rising line.  Only enable it where a retry costs more than a wrong reading.
+ *
+ * @param maxFlips 0 to disable, up to 3. (default 0)
+ */
+void dht_set_max_bit_flips(int maxFlips);
+
+/**
+ * Take the 0/1 bit threshold of every read from its preamble, which
+ * compensates sensors with a fast or slow clock and lines which rise
+ * slowly (long cables, weak pull-ups), instead of from the data lows alone.
+ * Reads whose preamble doesn't fit their data lows use the data lows.  The
+ * preamble is a single pulse, so on otherwise noisy lines this is less
+ * accurate than the default.  Takes precedence over the learned widths (see
+ * dht_set_learned_timing()), which are still learned, but not decoded with.
+ *
+ * @param enable 1 to calibrate on the preamble, 0 not to. (default 0)
+ */
+void dht_set_preamble_calibration(int enable);
+
+/**
+ * Learn the data widths of every sensor from its successful reads (see
+ * dht_model.h, and dht_model_open() to keep them between runs), and decode
+ * its reads with them.  The learned widths only ever widen the windows of
+ * the timing profile, so a sensor drifting away from them stays readable.
+ *
+ * @param enable 1 to learn and use the widths, 0 not to. (default 1)
+ */
+void dht_set_learned_timing(int enable);
+
+/**
+ * Set how many times dht_read() and dht_read_ex() read again after a failed
+ * read, as soon as the sensor allows (see dht_set_min_interval_millis()).
+ *
+ * @param retries 0 to read once. (default 9)
+ */
+void dht_set_retries(int retries);
+int dht_get_retries(void);
+
+/**
+ * Set how long the line of a sensor of (type) must have been idle high
+ * before the start signal.  The line is driven high only for what is left
+ * of it: a pin released by a read at least this long ago is started at once.
+ *
+ * @param type Sensor type. (ex. AM2302)
+ * @param millis Pre-charge time, 0 to never pre-charge. (default 500)
+ */
+void dht_set_precharge_millis(int type, uint32_t millis);
+
+/**
+ * Set the minimum time between two reads of a sensor of (type).  Reads,
+ * including retries, wait until this long after the previous start of the
+ * same pin, also by another process: the next slot is kept in the pin's
+ * lock file (see dht_set_lock_timeout_millis()) by its owner.  Processes
+ * which can't write the file wait for the others, but not the reverse.
+ *
+ * @param type Sensor type. (ex. AM2302)
+ * @param millis Minimum interval. (default 1000 for DHT11, 2000 for DHT22)
+ */
+void dht_set_min_interval_millis(int type, uint32_t millis);
+uint32_t dht_get_min_interval_millis(int type);
+
+/**
+ * Set the timing profile of sensors of (type).  The defaults follow the
+ * datasheets with room for the spread between sensors; narrower windows
+ * detect a missing or broken sensor sooner.
+ *
+ * @param type Sensor type. (ex. AM2302)
+ * @param profile Windows of every phase, NULL to restore the default.
+ */
+void dht_set_timing_profile(int type, const dht_timing_profile_t *profile);
+void dht_get_timing_profile(int type, dht_timing_profile_t *profile);
+
+/**
+ * Set the margin over the response delay learned for every pin.  Successful
+ * reads learn how soon the sensor answers, and later reads of the pin stop
+ * waiting for the response that much after it, so a disconnected sensor is
+ * given up within tens of microseconds.  A sensor not answering in time
+ * widens the learned delay by the margin, up to the profile's window.
+ *
+ * @param micros Margin, 0 to always wait the whole window. (default 30)
+ */
+void dht_set_response_margin_micros(uint32_t micros);
+
+/**
+ * Get how long a read of (pin) started now would wait for the minimum
+ * interval since the previous read.
+ *
+ * @param pin GPIO pin number. (ex. 4)
+ * @return Wait in milliseconds, 0 if the sensor can be read at once.
+ */
+uint32_t dht_read_wait_millis(int pin);
+
+/**
+ * Set how long a read waits for another thread or process reading the same
+ * pin.  Every pin has its own lock file, /run/lock/dht_read.<pin>.lck, so
+ * sensors on different pins can be read concurrently.
+ *
+ * @param millis 0 to retry once a second like a failed read (default),
+ *        -1 to wait as long as it takes, otherwise the longest wait after
+ *        which the read fails.
+ */
+void dht_set_lock_timeout_millis(int millis);
+
+// Counters of all reads since the start of the process.
+typedef struct {
+	unsigned long reads;		// Capture attempts.
+	unsigned long checksumErrors;	// Attempts failing the checksum.
+	unsigned long rescued;		// Checksum errors repaired by flipping bits.
+	unsigned long interrupted;	// Attempts with pulses corrected for interrupts.
+	unsigned long gapAborted;	// Captures aborted as a gap may have hidden a pulse.
+	// Complete polling captures made with a realtime profile (see
+	// realtime.h), and those of them corrected for interrupts, to compare
+	// how often interrupts hit captures with and without the profile.
+	unsigned long profiledReads;
+	unsigned long profiledInterrupted;
+} dht_stats_t;
+
+/**
+ * Get the read counters.
+ *
+ * @param pStats Pointer to struct where counters are copied.
+ */
+void dht_get_stats(dht_stats_t *pStats);
+
 #endif
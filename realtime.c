@@ -18,30 +18,49 @@
 // LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
+#define _GNU_SOURCE
+#include <alloca.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sched.h>
 #include <string.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "realtime.h"
 
-void busy_wait_milliseconds(uint32_t millis) {
-  // Set delay time period.
-  struct timeval deltatime;
-  deltatime.tv_sec = millis / 1000;
-  deltatime.tv_usec = (millis % 1000) * 1000;
-  struct timeval walltime;
-  // Get current time and add delay to find end time.
-  gettimeofday(&walltime, NULL);
-  struct timeval endtime;
-  timeradd(&walltime, &deltatime, &endtime);
-  // Tight loop to waste time (and CPU) until enough time as elapsed.
-  while (timercmp(&walltime, &endtime, <)) {
-    gettimeofday(&walltime, NULL);
+static uint32_t monotonic_raw_micros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void hybrid_wait_micros(uint32_t micros, uint32_t (*timer_micros)(void)) {
+  if (timer_micros == NULL) {
+    timer_micros = monotonic_raw_micros;
+  }
+  uint32_t started = timer_micros();
+  // Sleep while more than the spin is left.  CLOCK_MONOTONIC isn't stepped
+  // by NTP like the wall clock.
+  if (micros > REALTIME_SPIN_MICROS) {
+    uint32_t sleepMicros = micros - REALTIME_SPIN_MICROS;
+    struct timespec sleep;
+    sleep.tv_sec = sleepMicros / 1000000;
+    sleep.tv_nsec = (sleepMicros % 1000000) * 1000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &sleep, &sleep) == EINTR);
+  }
+  // Tight loop to waste time (and CPU) for the rest.
+  while (timer_micros() - started < micros) {
   }
 }
 
+void busy_wait_milliseconds(uint32_t millis) {
+  hybrid_wait_micros(millis * 1000, NULL);
+}
+
 void sleep_milliseconds(uint32_t millis) {
   struct timespec sleep;
   sleep.tv_sec = millis / 1000;
@@ -49,18 +68,125 @@ void sleep_milliseconds(uint32_t millis) {
   while (clock_nanosleep(CLOCK_MONOTONIC, 0, &sleep, &sleep) && errno == EINTR);
 }
 
+static realtime_profile_t profile = { -1, 0, 0 };
+// mlockall() is tried once: it fails the same way every time, and several
+// threads may capture.
+static pthread_once_t lockMemoryOnce = PTHREAD_ONCE_INIT;
+
+// Affinity of each thread before set_max_priority() moved it.
+static __thread cpu_set_t savedAffinity;
+static __thread int affinitySaved = 0;
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+// Layout of the kernel's struct sched_attr (first version), which not all
+// C libraries declare.
+struct thread_sched_attr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+};
+
+// Scheduling of each thread before set_max_priority() changed it.
+static __thread int schedSaved = 0;
+static __thread int savedPolicy;
+static __thread struct sched_param savedParam;
+static __thread int savedNice;
+
+static pid_t thread_id(void) {
+  return (pid_t)syscall(SYS_gettid);
+}
+
+static int get_sched_attr(struct thread_sched_attr *attr) {
+  memset(attr, 0, sizeof(*attr));
+  return (int)syscall(SYS_sched_getattr, 0, attr, sizeof(*attr), 0);
+}
+
+void set_realtime_profile(const realtime_profile_t *newProfile) {
+  if (newProfile != NULL) {
+    profile = *newProfile;
+  } else {
+    profile.cpu = -1;
+    profile.lockMemory = 0;
+    profile.prefaultStackBytes = 0;
+  }
+}
+
+int realtime_profile_active(void) {
+  return profile.cpu >= 0 || profile.lockMemory;
+}
+
+// Touch (bytes) of stack below the caller, one page at a time.
+static void __attribute__((noinline)) prefault_stack(size_t bytes) {
+  volatile char *stack = alloca(bytes);
+  size_t i;
+  for (i = 0; i < bytes; i += 4096) {
+    stack[i] = 0;
+  }
+}
+
+static void lock_memory(void) {
+  // Fails without CAP_IPC_LOCK or a high enough RLIMIT_MEMLOCK, which
+  // only costs determinism.
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
 void set_max_priority(void) {
+  if (profile.lockMemory) {
+    pthread_once(&lockMemoryOnce, lock_memory);
+  }
+  if (profile.prefaultStackBytes > 0) {
+    prefault_stack(profile.prefaultStackBytes);
+  }
+  // SCHED_DEADLINE threads (which pthread_getschedparam() doesn't report)
+  // already run ahead of any FIFO thread: leave them alone, on their CPUs.
+  struct thread_sched_attr attr;
+  if (!schedSaved && get_sched_attr(&attr) == 0 && attr.sched_policy == SCHED_DEADLINE) {
+    return;
+  }
+  if (profile.cpu >= 0 && !affinitySaved &&
+      pthread_getaffinity_np(pthread_self(), sizeof(savedAffinity), &savedAffinity) == 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(profile.cpu, &cpus);
+    affinitySaved = (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+  }
+  if (schedSaved) {
+    return;
+  }
+  if (pthread_getschedparam(pthread_self(), &savedPolicy, &savedParam) != 0) {
+    return;
+  }
+  errno = 0;
+  savedNice = getpriority(PRIO_PROCESS, thread_id());
+  if (errno != 0) {
+    savedNice = 0;
+  }
   struct sched_param sched;
   memset(&sched, 0, sizeof(sched));
   // Use FIFO scheduler with highest priority for the lowest chance of the kernel context switching.
   sched.sched_priority = sched_get_priority_max(SCHED_FIFO);
-  sched_setscheduler(0, SCHED_FIFO, &sched);
+  schedSaved = (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched) == 0);
 }
 
 void set_default_priority(void) {
-  struct sched_param sched;
-  memset(&sched, 0, sizeof(sched));
-  // Go back to default scheduler with default 0 priority.
-  sched.sched_priority = 0;
-  sched_setscheduler(0, SCHED_OTHER, &sched);
+  if (schedSaved) {
+    // Go back to the scheduling the thread had before set_max_priority().
+    pthread_setschedparam(pthread_self(), savedPolicy, &savedParam);
+    if (savedPolicy != SCHED_FIFO && savedPolicy != SCHED_RR) {
+      setpriority(PRIO_PROCESS, thread_id(), savedNice);
+    }
+    schedSaved = 0;
+  }
+  if (affinitySaved) {
+    pthread_setaffinity_np(pthread_self(), sizeof(savedAffinity), &savedAffinity);
+    affinitySaved = 0;
+  }
 }
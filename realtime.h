@@ -21,19 +21,51 @@
 #ifndef REALTIME_H
 #define REALTIME_H
 
+#include <stddef.h>
 #include <stdint.h>
 
-// Busy wait delay for most accurate timing, but high CPU usage.
-// Only use this for short periods of time (a few hundred milliseconds at most)!
+// Accurate delay: sleeps all but the last REALTIME_SPIN_MICROS, and busy waits
+// those on (timer_micros), a free running microsecond counter, or on
+// CLOCK_MONOTONIC_RAW if NULL.  The sleep absorbs the wake-up latency, so the
+// delay is never short and only late by the latency beyond the spin.
+void hybrid_wait_micros(uint32_t micros, uint32_t (*timer_micros)(void));
+
+// Time busy waited at the end of hybrid_wait_micros().
+#define REALTIME_SPIN_MICROS 200
+
+// Accurate delay for the start pulse: hybrid_wait_micros() on CLOCK_MONOTONIC_RAW.
 void busy_wait_milliseconds(uint32_t millis);
 
 // General delay that sleeps so CPU usage is low, but accuracy is potentially bad.
 void sleep_milliseconds(uint32_t millis);
 
-// Increase scheduling priority and algorithm to try to get 'real time' results.
+// Options applied by set_max_priority() for the timing critical capture.
+typedef struct {
+  // CPU the calling thread is moved to, ideally one kept free of other work
+  // with the isolcpus= kernel option.  -1 keeps the affinity of the thread.
+  int cpu;
+  // Lock all current and future memory of the process with mlockall(), so
+  // the capture takes no page faults.  Tried once, even if it fails, and
+  // never undone.
+  int lockMemory;
+  // Bytes of stack touched before the capture, so it is resident.
+  size_t prefaultStackBytes;
+} realtime_profile_t;
+
+// Set the options used by set_max_priority().  NULL restores the default:
+// no pinning, no memory locking, no stack prefault.
+void set_realtime_profile(const realtime_profile_t *profile);
+
+// Returns 1 if the profile pins the thread or locks memory.
+int realtime_profile_active(void);
+
+// Increase scheduling priority and algorithm of the calling thread to try to
+// get 'real time' results, and apply the realtime profile.  Threads running
+// SCHED_DEADLINE keep their scheduling.
 void set_max_priority(void);
 
-// Drop scheduling priority back to normal/default.
+// Restore the scheduling policy, priority, nice value and CPU affinity the
+// calling thread had before set_max_priority().
 void set_default_priority(void);
 
 #endif
@@ -0,0 +1,251 @@
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pi_dht_read.h"
+#include "dht_async.h"
+#include "dht_trace.h"
+#include "dht_backend.h"
+#include "dht_model.h"
+#include "dht_sim.h"
+
+// GPIO pin number for the simulated DHT sensor
+#define DHTPIN 4
+
+static double nowSeconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static float humidity, temperature;
+static int failures = 0;
+// Sampling resolution of the last capture.
+static uint32_t sampleNanos;
+
+static void onReading(int success, const dht_result_t *pResult, void *ctx) {
+	int *pRemaining = ctx;
+	if (success) {
+		humidity = pResult->humidity;
+		temperature = pResult->temperature;
+		sampleNanos = pResult->sampleNanos;
+	} else {
+		failures++;
+	}
+	(*pRemaining)--;
+}
+
+// Queue all reads at once, and wait for the completions in a poll loop.
+static int readAsync(int type, int count) {
+	int fd = dht_async_init();
+	if (fd < 0) {
+		printf("dht_async_init failed: %d\n", fd);
+		return -1;
+	}
+	int queued = 0;
+	int remaining = count;
+	while (remaining > 0) {
+		while (queued < count && dht_read_async(type, DHTPIN, onReading, &remaining) >= 0) {
+			queued++;
+		}
+		struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+		poll(&pfd, 1, -1);
+		dht_async_dispatch();
+	}
+	dht_async_shutdown();
+	return 0;
+}
+
+// Read sensors on MANY_PINS pins together, reporting different values.
+#define MANY_PINS 8
+
+static int readMany(int type, int count) {
+	int types[MANY_PINS], pins[MANY_PINS];
+	dht_result_t results[MANY_PINS];
+	int i, j;
+	for (j = 0; j < MANY_PINS; j++) {
+		types[j] = type;
+		pins[j] = DHTPIN + 1 + j;
+		if (dht_sim_attach(pins[j], type, 40.0f + j, type == DHT11 ? 20.0f + j : -5.5f * j) < 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		dht_read_many(MANY_PINS, types, pins, results);
+		for (j = 0; j < MANY_PINS; j++) {
+			if (!results[j].success || results[j].humidity != 40.0f + j) {
+				failures++;
+			}
+		}
+	}
+	humidity = results[MANY_PINS - 1].humidity;
+	temperature = results[MANY_PINS - 1].temperature;
+	sampleNanos = results[MANY_PINS - 1].sampleNanos;
+	printf("%d sensors per read\n", MANY_PINS);
+	return 0;
+}
+
+// Reads of a nominal sensor the timing model learns from before it drifts.
+#define DRIFT_LEARN_READS 50
+// Clock error of the drifted sensor, in percent.
+#define DRIFT_PERCENT 20
+
+// Read a sensor whose clock drifts once the timing model has learned it,
+// first slower then faster.  Every read must still succeed.
+static int readDrift(int type, int count) {
+	int i, skew;
+	for (skew = -DRIFT_PERCENT; skew <= DRIFT_PERCENT; skew += 2 * DRIFT_PERCENT) {
+		dht_sim_set_clock_skew(DHTPIN, 0);
+		dht_model_forget(type, DHTPIN);
+		for (i = 0; i < DRIFT_LEARN_READS; i++) {
+			dht_result_t result;
+			dht_read_ex(type, DHTPIN, &result);
+		}
+		dht_sim_set_clock_skew(DHTPIN, skew);
+		for (i = 0; i < count; i++) {
+			dht_result_t result;
+			if (!dht_read_ex(type, DHTPIN, &result) || result.retries > 0) {
+				failures++;
+			} else {
+				humidity = result.humidity;
+				temperature = result.temperature;
+				sampleNanos = result.sampleNanos;
+			}
+		}
+	}
+	printf("clock drifted by -%d%% and +%d%% after %d reads\n", DRIFT_PERCENT, DRIFT_PERCENT, DRIFT_LEARN_READS);
+	return 0;
+}
+
+// Preemption of the reader: on average every PREEMPT_INTERVAL_MICROS, for up
+// to PREEMPT_MAX_MICROS, enough to hide whole pulses now and then.
+#define PREEMPT_INTERVAL_MICROS 300
+#define PREEMPT_MAX_MICROS 40
+
+// Random bytes with a valid checksum, so every bit pattern gets a chance to
+// be misread.
+static void randomBytes(uint8_t data[DHT_BYTES]) {
+	int i;
+	data[4] = 0;
+	for (i = 0; i < 4; i++) {
+		data[i] = (uint8_t)rand();
+		data[4] += data[i];
+	}
+}
+
+// Read sensors on (pins) pins, one with dht_read_ex(), more with
+// dht_read_many(), with the reader preempted and slower line reads.  Reads
+// may fail, but none may return other bytes than sent.
+static int readPreempt(int type, int count, int pins) {
+	int types[MANY_PINS], pinNumbers[MANY_PINS];
+	uint8_t sent[MANY_PINS][DHT_BYTES];
+	dht_result_t results[MANY_PINS];
+	int accepted = 0;
+	int i, j;
+	for (j = 0; j < pins; j++) {
+		types[j] = type;
+		pinNumbers[j] = (pins == 1) ? DHTPIN : DHTPIN + 1 + j;
+		if (dht_sim_attach(pinNumbers[j], type, 0.0f, 0.0f) < 0) {
+			return -1;
+		}
+	}
+	// Every capture is checked, not only the last of its retries.
+	dht_set_retries(0);
+	dht_sim_set_read_costs(150, 250);
+	dht_sim_set_preemption(PREEMPT_INTERVAL_MICROS, PREEMPT_MAX_MICROS);
+	srand(1);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < pins; j++) {
+			randomBytes(sent[j]);
+			dht_sim_set_bytes(pinNumbers[j], sent[j]);
+		}
+		if (pins == 1) {
+			dht_read_ex(type, DHTPIN, &results[0]);
+		} else {
+			dht_read_many(pins, types, pinNumbers, results);
+		}
+		for (j = 0; j < pins; j++) {
+			if (!results[j].success) {
+				continue;
+			}
+			accepted++;
+			if (memcmp(results[j].data, sent[j], DHT_BYTES) != 0) {
+				failures++;
+			}
+			humidity = results[j].humidity;
+			temperature = results[j].temperature;
+			sampleNanos = results[j].sampleNanos;
+		}
+	}
+	dht_sim_set_preemption(0, 0);
+	printf("preempted every ~%d us for up to %d us: %d of %d reads accepted, %d wrong\n",
+		PREEMPT_INTERVAL_MICROS, PREEMPT_MAX_MICROS, accepted, count * pins, failures);
+	return 0;
+}
+
+int main(int argc, const char **argv) {
+	int count = argc < 2 ? 100000 : atoi(argv[1]);
+	int type = argc < 3 ? AM2302 : atoi(argv[2]);
+	const char *mode = argc < 4 ? "sync" : argv[3];
+	int async = strcmp(mode, "async") == 0;
+	int many = strcmp(mode, "many") == 0;
+	int drift = strcmp(mode, "drift") == 0;
+	int preempt = strcmp(mode, "preempt") == 0;
+	int preemptMany = strcmp(mode, "preempt-many") == 0;
+	if (strcmp(mode, "sync") != 0 && !async && !many && !drift && !preempt && !preemptMany) {
+		printf("usage: sim_dht_read [COUNT [TYPE [sync|async|many|drift|preempt|preempt-many [TRACE_FILE]]]]\n");
+		return 2;
+	}
+	const char *tracePath = argc < 5 ? NULL : argv[4];
+
+	dht_sim_reset();
+	if (dht_sim_attach(DHTPIN, type, 45.6f, type == DHT11 ? 23.0f : -12.3f) < 0) {
+		printf("Unsupported sensor type %d\n", type);
+		return 1;
+	}
+	dht_set_backend(&dht_sim_backend);
+	// Simulated sensors can be read back to back.
+	dht_set_min_interval_millis(DHT11, 0);
+	dht_set_min_interval_millis(DHT22, 0);
+	if (tracePath != NULL && dht_trace_start(tracePath, count < 65536 ? count : 65536, 0) != DHT_TRACE_SUCCESS) {
+		printf("Cannot record traces to %s\n", tracePath);
+		return 1;
+	}
+
+	double started = nowSeconds();
+	int i;
+	if (async) {
+		if (readAsync(type, count) < 0) {
+			return 1;
+		}
+	} else if (drift) {
+		if (readDrift(type, count) < 0) {
+			return 1;
+		}
+	} else if (preempt || preemptMany) {
+		if (readPreempt(type, count, preemptMany ? MANY_PINS : 1) < 0) {
+			return 1;
+		}
+	} else if (many) {
+		if (readMany(type, count) < 0) {
+			return 1;
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			dht_result_t result;
+			if (!dht_read_ex(type, DHTPIN, &result)) {
+				failures++;
+			} else {
+				humidity = result.humidity;
+				temperature = result.temperature;
+				sampleNanos = result.sampleNanos;
+			}
+		}
+	}
+	double elapsed = nowSeconds() - started;
+	printf("temperature:%.1f Humidity:%.1f\n", temperature, humidity);
+	printf("%d reads, %d failures, %.0f reads/s\n", count, failures, count / elapsed);
+	printf("line sampled every %u ns\n", sampleNanos);
+	return failures != 0;
+}
@@ -0,0 +1,133 @@
+// Feed edge events through a pipe to the gpiochip backend's edge reader, as
+// the kernel would deliver them from a line request, and check the widths it
+// takes from them.  Exits with an error if any case fails.
+#include <linux/gpio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "pi_dht_read.h"
+#include "gpiochip.h"
+
+#define TIMEOUT_MS 20
+
+// Widths of the response sent, preamble pulse first.
+static uint32_t sentLow[DHT_PULSES + 1];
+static uint32_t sentHigh[DHT_PULSES];
+
+static struct gpio_v2_line_event events[DHT_EDGES + 1];
+static int eventCount;
+
+static void addEvent(uint32_t id, uint64_t timestampNanos, uint32_t seqno) {
+	struct gpio_v2_line_event *e = &events[eventCount++];
+	memset(e, 0, sizeof(*e));
+	e->id = id;
+	e->timestamp_ns = timestampNanos;
+	e->line_seqno = seqno;
+}
+
+// Fill events with a response of alternating 0 and 1 bits, preceded by the
+// pull-up edge if (pullUp), and without its first falling edge if (lostFall).
+static void makeResponse(int pullUp, int lostFall) {
+	int i;
+	for (i = 0; i <= DHT_PULSES; i++) {
+		sentLow[i] = (i == 0) ? 80 : 50 + i % 3;
+		if (i < DHT_PULSES) {
+			sentHigh[i] = (i == 0) ? 80 : (i & 1) ? 70 : 27;
+		}
+	}
+	eventCount = 0;
+	uint32_t seqno = 1;
+	// Odd nanoseconds, which are rounded to the nearest microsecond.
+	uint64_t t = 1000000000ull + 123;
+	if (pullUp) {
+		addEvent(GPIO_V2_LINE_EVENT_RISING_EDGE, t - 30000, seqno++);
+	}
+	for (i = 0; i <= DHT_PULSES; i++) {
+		if (i > 0 || !lostFall) {
+			addEvent(GPIO_V2_LINE_EVENT_FALLING_EDGE, t, seqno++);
+		}
+		t += sentLow[i] * 1000 + 400;
+		addEvent(GPIO_V2_LINE_EVENT_RISING_EDGE, t, seqno++);
+		if (i < DHT_PULSES) {
+			t += sentHigh[i] * 1000 - 400;
+		}
+	}
+}
+
+// Write the events to a pipe, closed after them, and read them back.
+static int readEvents(uint32_t lowMicros[], uint32_t highMicros[]) {
+	int fds[2];
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		return GPIOCHIP_ERROR_OPEN;
+	}
+	ssize_t size = eventCount * sizeof(events[0]);
+	if (write(fds[1], events, size) != size) {
+		perror("write");
+	}
+	close(fds[1]);
+	int result = dht_gpiochip_read_edges(fds[0], TIMEOUT_MS, lowMicros, highMicros);
+	close(fds[0]);
+	return result;
+}
+
+// Check a read of the response made, with the preamble low lost if (lostLow).
+static int check(const char *name, int lostLow) {
+	uint32_t lowMicros[DHT_PULSES + 1];
+	uint32_t highMicros[DHT_PULSES];
+	int result = readEvents(lowMicros, highMicros);
+	if (result != GPIOCHIP_SUCCESS) {
+		printf("%s: error %d\n", name, result);
+		return 1;
+	}
+	int i;
+	for (i = 0; i <= DHT_PULSES; i++) {
+		// The 400 ns moved from each high to the low before it round off.
+		uint32_t low = (i == 0 && lostLow) ? 0 : sentLow[i];
+		if (lowMicros[i] != low || (i < DHT_PULSES && highMicros[i] != sentHigh[i])) {
+			printf("%s: pulse %d low %u high %u, sent %u %u\n", name, i,
+				lowMicros[i], (i < DHT_PULSES) ? highMicros[i] : 0, low, (i < DHT_PULSES) ? sentHigh[i] : 0);
+			return 1;
+		}
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+static int checkError(const char *name, int expected) {
+	uint32_t lowMicros[DHT_PULSES + 1];
+	uint32_t highMicros[DHT_PULSES];
+	int result = readEvents(lowMicros, highMicros);
+	if (result != expected) {
+		printf("%s: returned %d, expected %d\n", name, result, expected);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+int main(void) {
+	int failures = 0;
+
+	makeResponse(0, 0);
+	failures += check("response", 0);
+
+	makeResponse(1, 0);
+	failures += check("pull-up", 0);
+
+	makeResponse(0, 1);
+	failures += check("lost fall", 1);
+
+	// An event dropped in the middle, as when the kernel buffer overflows.
+	makeResponse(0, 0);
+	int i;
+	for (i = DHT_EDGES / 2; i < eventCount; i++) {
+		events[i].line_seqno++;
+	}
+	failures += checkError("sequence", GPIOCHIP_ERROR_SEQUENCE);
+
+	eventCount = 0;
+	failures += checkError("timeout", GPIOCHIP_ERROR_TIMEOUT);
+
+	return failures ? 1 : 0;
+}